@@ -0,0 +1,475 @@
+
+/*
+ * thread pool microbenchmarks, every result is printed as one JSON object
+ * per line:
+ *
+ *   ./bench [-n tasks] [-b post|latency|size|scale] [pool params ...]
+ *
+ * pool params are passed to ngx_thread_pool_set() for every pool the
+ * benchmarks create, e.g. ./bench queue=ring park=futex
+ */
+
+
+#include "ngx_common.h"
+#include "ngx_atomic.h"
+#include "ngx_thread.h"
+#include "ngx_thread_pool.h"
+#include "flog.h"
+
+
+typedef struct {
+    ngx_thread_pool_t   *tp;
+    ngx_uint_t           tasks;
+    uint64_t             work;
+} bench_producer_t;
+
+
+static uint64_t bench_nsec(void);
+static void bench_spin(uint64_t ns);
+static ngx_thread_pool_t *bench_pool(ngx_uint_t threads);
+static void bench_drain(ngx_thread_pool_t *tp, ngx_uint_t tasks);
+static void bench_done(ngx_thread_pool_t *tp);
+static void *bench_producer(void *data);
+static void bench_work_handler(void *data);
+static void bench_latency_handler(void *data);
+static int bench_cmp(const void *one, const void *two);
+static double bench_run(ngx_uint_t threads, ngx_uint_t producers,
+    ngx_uint_t tasks, uint64_t work);
+static void bench_post(ngx_uint_t tasks);
+static void bench_latency(ngx_uint_t tasks);
+static void bench_size(ngx_uint_t tasks);
+static void bench_scale(ngx_uint_t tasks);
+
+
+static char        **bench_params;
+static int           bench_nparams;
+static ngx_uint_t    bench_npools;
+static char          bench_conf[256];
+
+
+static uint64_t
+bench_nsec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void
+bench_spin(uint64_t ns)
+{
+    uint64_t  start;
+
+    if (ns == 0) {
+        return;
+    }
+
+    start = bench_nsec();
+
+    while (bench_nsec() - start < ns) {
+        ngx_cpu_pause();
+    }
+}
+
+
+/* pools live until exit, so every run gets a pool of its own */
+
+static ngx_thread_pool_t *
+bench_pool(ngx_uint_t threads)
+{
+    int                 i;
+    char                name[32], param[32];
+    ngx_thread_pool_t  *tp;
+
+    snprintf(name, sizeof(name), "bench%lu", bench_npools++);
+
+    tp = ngx_thread_pool_add(name);
+    if (tp == NULL) {
+        exit(1);
+    }
+
+    snprintf(param, sizeof(param), "threads=%lu", threads);
+
+    if (ngx_thread_pool_set(tp, param) != NGX_OK) {
+        exit(1);
+    }
+
+    for (i = 0; i < bench_nparams; i++) {
+        if (ngx_thread_pool_set(tp, bench_params[i]) != NGX_OK) {
+            fprintf(stderr, "invalid pool parameter \"%s\"\n",
+                    bench_params[i]);
+            exit(1);
+        }
+    }
+
+    if (ngx_thread_pool_init_worker(tp) != NGX_OK) {
+        fprintf(stderr, "ngx_thread_pool_init_worker() failed\n");
+        exit(1);
+    }
+
+    return tp;
+}
+
+
+/* completions are read from the per worker counters, not counted here */
+
+static void
+bench_drain(ngx_thread_pool_t *tp, ngx_uint_t tasks)
+{
+    ngx_thread_pool_stats_t  stats;
+
+    for ( ;; ) {
+        (void) ngx_thread_pool_stats(tp, &stats, NULL, 0);
+
+        if (stats.total.completed >= tasks) {
+            return;
+        }
+
+        ngx_sched_yield();
+    }
+}
+
+
+static void
+bench_done(ngx_thread_pool_t *tp)
+{
+    (void) ngx_thread_pool_shutdown(tp, NGX_THREAD_POOL_DRAIN, 0, NULL);
+}
+
+
+static void *
+bench_producer(void *data)
+{
+    bench_producer_t *p = data;
+
+    ngx_uint_t          i;
+    ngx_thread_task_t  *task;
+
+    for (i = 0; i < p->tasks; i++) {
+        task = ngx_thread_task_alloc(p->tp, sizeof(uint64_t));
+        if (task == NULL) {
+            exit(1);
+        }
+
+        task->handler = bench_work_handler;
+        *(uint64_t *) task->ctx = p->work;
+
+        if (ngx_thread_task_post_wait(p->tp, task, NGX_TIMER_INFINITE)
+            != NGX_OK)
+        {
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+bench_work_handler(void *data)
+{
+    bench_spin(*(uint64_t *) data);
+}
+
+
+static void
+bench_latency_handler(void *data)
+{
+    *(uint64_t *) data = bench_nsec();
+}
+
+
+static int
+bench_cmp(const void *one, const void *two)
+{
+    uint64_t  a, b;
+
+    a = *(const uint64_t *) one;
+    b = *(const uint64_t *) two;
+
+    return (a > b) - (a < b);
+}
+
+
+/* returns tasks per second from the first post to the last completion */
+
+static double
+bench_run(ngx_uint_t threads, ngx_uint_t producers, ngx_uint_t tasks,
+    uint64_t work)
+{
+    uint64_t            start, end;
+    ngx_uint_t          i;
+    pthread_t          *tids;
+    bench_producer_t   *p;
+    ngx_thread_pool_t  *tp;
+
+    tp = bench_pool(threads);
+
+    tids = calloc(producers, sizeof(pthread_t));
+    p = calloc(producers, sizeof(bench_producer_t));
+
+    if (tids == NULL || p == NULL) {
+        exit(1);
+    }
+
+    start = bench_nsec();
+
+    for (i = 0; i < producers; i++) {
+        p[i].tp = tp;
+        p[i].tasks = tasks / producers;
+        p[i].work = work;
+
+        if (pthread_create(&tids[i], NULL, bench_producer, &p[i]) != 0) {
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < producers; i++) {
+        (void) pthread_join(tids[i], NULL);
+    }
+
+    bench_drain(tp, tasks / producers * producers);
+
+    end = bench_nsec();
+
+    bench_done(tp);
+
+    free(tids);
+    free(p);
+
+    return (double) (tasks / producers * producers) * 1e9 / (end - start);
+}
+
+
+/* post throughput of empty tasks as producers are added */
+
+static void
+bench_post(ngx_uint_t tasks)
+{
+    double      rate;
+    ngx_uint_t  producers;
+
+    for (producers = 1; producers <= (ngx_uint_t) ngx_ncpu * 2;
+         producers *= 2)
+    {
+        rate = bench_run(ngx_ncpu, producers, tasks, 0);
+
+        printf("{\"bench\":\"post\",\"conf\":\"%s\",\"workers\":%ld,"
+               "\"producers\":%lu,\"tasks\":%lu,\"tasks_per_sec\":%.0f}\n",
+               bench_conf, (long) ngx_ncpu, producers, tasks, rate);
+    }
+}
+
+
+/*
+ * handoff latency of an empty task posted to an idle pool, from the post
+ * to the start of its handler
+ */
+
+static void
+bench_latency(ngx_uint_t tasks)
+{
+    uint64_t             *samples, start;
+    ngx_uint_t            i;
+    ngx_thread_task_t    *task;
+    ngx_thread_pool_t    *tp;
+    ngx_thread_future_t   future;
+
+    if (tasks > 100000) {
+        tasks = 100000;
+    }
+
+    samples = malloc(tasks * sizeof(uint64_t));
+    if (samples == NULL) {
+        exit(1);
+    }
+
+    tp = bench_pool(ngx_ncpu);
+
+    for (i = 0; i < tasks; i++) {
+        task = ngx_thread_task_alloc(tp, 0);
+        if (task == NULL) {
+            exit(1);
+        }
+
+        task->handler = bench_latency_handler;
+        task->ctx = &samples[i];
+
+        ngx_thread_future_init(&future);
+
+        start = bench_nsec();
+
+        if (ngx_thread_task_post_future(tp, task, &future) != NGX_OK) {
+            exit(1);
+        }
+
+        (void) ngx_thread_future_wait(&future, NGX_TIMER_INFINITE);
+
+        samples[i] -= start;
+    }
+
+    bench_done(tp);
+
+    qsort(samples, tasks, sizeof(uint64_t), bench_cmp);
+
+    printf("{\"bench\":\"latency\",\"conf\":\"%s\",\"workers\":%ld,"
+           "\"tasks\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,"
+           "\"max_ns\":%lu}\n",
+           bench_conf, (long) ngx_ncpu, tasks,
+           (ngx_uint_t) samples[tasks / 2],
+           (ngx_uint_t) samples[tasks * 99 / 100],
+           (ngx_uint_t) samples[tasks * 999 / 1000],
+           (ngx_uint_t) samples[tasks - 1]);
+
+    free(samples);
+}
+
+
+/* throughput and efficiency against an ideal pool as tasks get longer */
+
+static void
+bench_size(ngx_uint_t tasks)
+{
+    double      rate, ideal;
+    uint64_t    work;
+    ngx_uint_t  n;
+
+    for (work = 0; work <= 100000; work = work ? work * 10 : 100) {
+
+        /* keep a run under a second or so of worker time */
+
+        n = work ? 1000000000 / work * ngx_ncpu / 4 : tasks;
+
+        if (n > tasks) {
+            n = tasks;
+        }
+
+        rate = bench_run(ngx_ncpu, 1, n, work);
+        ideal = work ? 1e9 * ngx_ncpu / work : 0;
+
+        printf("{\"bench\":\"size\",\"conf\":\"%s\",\"workers\":%ld,"
+               "\"work_ns\":%lu,\"tasks\":%lu,\"tasks_per_sec\":%.0f,"
+               "\"efficiency\":%.3f}\n",
+               bench_conf, (long) ngx_ncpu, (ngx_uint_t) work, n, rate,
+               ideal ? rate / ideal : 0);
+    }
+}
+
+
+/* throughput of 10us tasks from 1 to ngx_ncpu workers */
+
+static void
+bench_scale(ngx_uint_t tasks)
+{
+    double      rate, base;
+    ngx_uint_t  threads, n;
+
+    base = 0;
+
+    n = tasks / 10;
+
+    for (threads = 1; /* void */; threads *= 2) {
+
+        /* the last step is ngx_ncpu itself */
+
+        if (threads > (ngx_uint_t) ngx_ncpu) {
+            threads = ngx_ncpu;
+        }
+
+        rate = bench_run(threads, 1, n, 10000);
+
+        if (threads == 1) {
+            base = rate;
+        }
+
+        printf("{\"bench\":\"scale\",\"conf\":\"%s\",\"workers\":%lu,"
+               "\"work_ns\":10000,\"tasks\":%lu,\"tasks_per_sec\":%.0f,"
+               "\"speedup\":%.2f}\n",
+               bench_conf, threads, n, rate, rate / base);
+
+        if (threads == (ngx_uint_t) ngx_ncpu) {
+            break;
+        }
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    int          c, i;
+    size_t       len;
+    const char  *bench;
+    ngx_uint_t   tasks;
+
+    Flogconf logconf = {"/tmp/tmplog/bench",LOGFILE_DEFMAXSIZE,L_ERROR,0,1};
+    if (0 > LOG_INIT(logconf)) {
+        printf("LOG_INIT() failed\n");
+        return -1;
+    }
+
+    tasks = 200000;
+    bench = NULL;
+
+    while ((c = getopt(argc, argv, "n:b:h")) != -1) {
+        switch (c) {
+
+        case 'n':
+            tasks = strtoul(optarg, NULL, 10);
+            if (tasks == 0) {
+                goto usage;
+            }
+            break;
+
+        case 'b':
+            bench = optarg;
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+
+    bench_params = &argv[optind];
+    bench_nparams = argc - optind;
+
+    len = 0;
+
+    for (i = 0; i < bench_nparams && len < sizeof(bench_conf) - 1; i++) {
+        len += snprintf(bench_conf + len, sizeof(bench_conf) - len, "%s%s",
+                        i ? " " : "", bench_params[i]);
+    }
+
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (bench == NULL || strcmp(bench, "post") == 0) {
+        bench_post(tasks);
+    }
+
+    if (bench == NULL || strcmp(bench, "latency") == 0) {
+        bench_latency(tasks);
+    }
+
+    if (bench == NULL || strcmp(bench, "size") == 0) {
+        bench_size(tasks);
+    }
+
+    if (bench == NULL || strcmp(bench, "scale") == 0) {
+        bench_scale(tasks);
+    }
+
+    LOG_EXIT;
+
+    return 0;
+
+usage:
+
+    fprintf(stderr, "usage: %s [-n tasks] [-b post|latency|size|scale] "
+            "[pool params ...]\n", argv[0]);
+
+    LOG_EXIT;
+
+    return 1;
+}
@@ -26,18 +26,23 @@ int main(int argc, char* argv[])
         goto done;
     }
     
-    ngx_thread_task_t    task;
-    ngx_memzero(&task, sizeof(ngx_thread_task_t));
+    ngx_thread_task_t   *task = ngx_thread_task_alloc(tp, sizeof(int));
+    if (task == NULL) {
+        goto done;
+    }
 
-    task.handler = ngx_thread_handler;
-    int data = 1;
-    task.ctx = (void *) &data;
+    task->handler = ngx_thread_handler;
+    *(int *) task->ctx = 1;
+
+    ngx_thread_future_t  future;
+    ngx_thread_future_init(&future);
     
-    if (ngx_thread_task_post(tp, &task) != NGX_OK) {
-        return;
+    if (ngx_thread_task_post_future(tp, task, &future) != NGX_OK) {
+        ngx_thread_task_free(task);
+        goto done;
     }
     
-    sleep(1);
+    (void) ngx_thread_future_wait(&future, NGX_TIMER_INFINITE);
     
 done:
     ngx_thread_pool_exit_worker(tp);
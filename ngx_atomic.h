@@ -33,6 +33,17 @@ typedef volatile ngx_atomic_uint_t  ngx_atomic_t;
 
 #define ngx_memory_barrier()        __sync_synchronize()
 
+/* GCC 4.7 builtin atomic operations with explicit ordering */
+
+#define ngx_atomic_load(value)                                                \
+    __atomic_load_n(value, __ATOMIC_ACQUIRE)
+
+#define ngx_atomic_store(value, set)                                          \
+    __atomic_store_n(value, set, __ATOMIC_RELEASE)
+
+#define ngx_atomic_swap(value, set)                                           \
+    __atomic_exchange_n(value, set, __ATOMIC_ACQ_REL)
+
 #if ( __i386__ || __i386 || __amd64__ || __amd64 )
 #define ngx_cpu_pause()             __asm__ ("pause")
 #else
@@ -12,6 +12,10 @@
 //#include <ngx_config.h>
 //#include <ngx_core.h>
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* pthread_attr_setaffinity_np(), CPU_SET() */
+#endif
+
 //#if (NGX_THREADS)
 
 #include <stdint.h>
@@ -28,6 +32,7 @@
 #include <signal.h>
 #include <pthread.h>
 #include <sys/syscall.h> 
+#include <time.h>
 
 #define  NGX_OK          0
 #define  NGX_ERROR      -1
@@ -39,7 +44,13 @@
 
 typedef intptr_t        ngx_int_t;
 typedef uintptr_t       ngx_uint_t;
+
+#define NGX_MAX_INT_T_VALUE  INTPTR_MAX
 typedef int               ngx_err_t;
+typedef ngx_uint_t        ngx_msec_t;
+typedef ngx_int_t         ngx_msec_int_t;
+
+#define NGX_TIMER_INFINITE  (ngx_msec_t) -1
 
 //have sched.h
 #define NGX_HAVE_SCHED_YIELD 1
@@ -50,10 +61,36 @@ typedef int               ngx_err_t;
 #define ngx_sched_yield()  usleep(1)
 #endif
 
+//have sched_setaffinity()
+#define NGX_HAVE_SCHED_SETAFFINITY 1
+
+//have futex(2)
+#define NGX_HAVE_FUTEX 1
+
+#if (NGX_HAVE_FUTEX)
+#include <linux/futex.h>
+#endif
+
+//have sys/eventfd.h
+#define NGX_HAVE_EVENTFD 1
+
+#if (NGX_HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
+
+//have io_uring(7), linux 5.1
+#define NGX_HAVE_IO_URING 1
+
+#if (NGX_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#endif
+
 
 #define ngx_memzero(buf, n)       (void) memset(buf, 0, n)
 #define ngx_memset(buf, c, n)     (void) memset(buf, c, n)
 
 #define NGX_LINUX 1
 
+#define NGX_CPU_CACHE_LINE  64
+
 #endif /* _NGX_COMMON_H_INCLUDED_ */
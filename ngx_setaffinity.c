@@ -0,0 +1,283 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include "ngx_common.h"
+#include "ngx_setaffinity.h"
+#include "flog.h"
+
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+#include <dirent.h>
+
+
+static ngx_int_t ngx_cpu_read_int(const char *fmt, int cpu, int *value);
+static void ngx_cpu_read_nodes(void);
+static int ngx_cpu_cmp_core(const void *one, const void *two);
+
+
+static ngx_cpu_t   ngx_cpus[CPU_SETSIZE];
+static ngx_uint_t  ngx_ncpus;
+static ngx_uint_t  ngx_nnodes;
+static int         ngx_cpu_nodes_map[CPU_SETSIZE];
+
+
+ngx_cpu_t *
+ngx_cpu_topology(ngx_uint_t *n)
+{
+    int            cpu;
+    ngx_uint_t     i;
+    ngx_cpu_t     *c;
+    ngx_cpuset_t   set;
+
+    if (ngx_ncpus) {
+        *n = ngx_ncpus;
+        return ngx_cpus;
+    }
+
+    if (sched_getaffinity(0, sizeof(ngx_cpuset_t), &set) == -1) {
+        LOG_ERROR("sched_getaffinity() failed, errno %d", errno);
+        CPU_ZERO(&set);
+        CPU_SET(0, &set);
+    }
+
+    ngx_cpu_read_nodes();
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) {
+            continue;
+        }
+
+        c = &ngx_cpus[ngx_ncpus++];
+
+        c->cpu = cpu;
+        c->node = ngx_cpu_nodes_map[cpu];
+
+        if (ngx_cpu_read_int("/sys/devices/system/cpu/cpu%d/topology/"
+                             "physical_package_id", cpu, &c->package)
+            != NGX_OK)
+        {
+            c->package = c->node;
+        }
+
+        if (ngx_cpu_read_int("/sys/devices/system/cpu/cpu%d/topology/core_id",
+                             cpu, &c->core)
+            != NGX_OK)
+        {
+            c->core = cpu;
+        }
+    }
+
+    /* rank siblings within cores and cores within packages */
+
+    qsort(ngx_cpus, ngx_ncpus, sizeof(ngx_cpu_t), ngx_cpu_cmp_core);
+
+    for (i = 0; i < ngx_ncpus; i++) {
+        c = &ngx_cpus[i];
+
+        if (i && c->package == c[-1].package && c->core == c[-1].core) {
+            c->smt = c[-1].smt + 1;
+            c->core_rank = c[-1].core_rank;
+
+        } else if (i && c->package == c[-1].package) {
+            c->smt = 0;
+            c->core_rank = c[-1].core_rank + 1;
+
+        } else {
+            c->smt = 0;
+            c->core_rank = 0;
+        }
+    }
+
+    *n = ngx_ncpus;
+
+    return ngx_cpus;
+}
+
+
+ngx_uint_t
+ngx_cpu_nodes(void)
+{
+    ngx_uint_t  n;
+
+    (void) ngx_cpu_topology(&n);
+
+    return ngx_nnodes;
+}
+
+
+int
+ngx_cpu_node(int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return 0;
+    }
+
+    return ngx_cpu_nodes_map[cpu];
+}
+
+
+int
+ngx_current_node(void)
+{
+    return ngx_cpu_node(sched_getcpu());
+}
+
+
+ngx_int_t
+ngx_cpuset_parse(const char *list, ngx_cpuset_t *set)
+{
+    char  *p;
+    long   from, to;
+
+    CPU_ZERO(set);
+
+    p = (char *) list;
+
+    while (*p) {
+        if (*p < '0' || *p > '9') {
+            return NGX_ERROR;
+        }
+
+        from = strtol(p, &p, 10);
+        to = from;
+
+        if (*p == '-') {
+            p++;
+
+            if (*p < '0' || *p > '9') {
+                return NGX_ERROR;
+            }
+
+            to = strtol(p, &p, 10);
+        }
+
+        if (from > to || to >= CPU_SETSIZE) {
+            return NGX_ERROR;
+        }
+
+        while (from <= to) {
+            CPU_SET(from++, set);
+        }
+
+        if (*p == ',') {
+            p++;
+
+        } else if (*p) {
+            return NGX_ERROR;
+        }
+    }
+
+    return CPU_COUNT(set) ? NGX_OK : NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_cpu_read_int(const char *fmt, int cpu, int *value)
+{
+    int    n;
+    char   path[128];
+    FILE  *f;
+
+    snprintf(path, sizeof(path), fmt, cpu);
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = fscanf(f, "%d", value);
+
+    fclose(f);
+
+    return (n == 1) ? NGX_OK : NGX_ERROR;
+}
+
+
+static void
+ngx_cpu_read_nodes(void)
+{
+    int             node, cpu;
+    DIR            *dir;
+    char            path[300], list[4096];
+    FILE           *f;
+    ngx_cpuset_t    set;
+    struct dirent  *de;
+
+    ngx_nnodes = 1;
+
+    dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "node", 4) != 0
+            || de->d_name[4] < '0' || de->d_name[4] > '9')
+        {
+            continue;
+        }
+
+        node = atoi(de->d_name + 4);
+
+        if (node < 0 || node >= CPU_SETSIZE) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+                 de->d_name);
+
+        f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+
+        if (fgets(list, sizeof(list), f) == NULL) {
+            fclose(f);
+            continue;
+        }
+
+        fclose(f);
+
+        list[strcspn(list, "\n")] = '\0';
+
+        if (list[0] == '\0' || ngx_cpuset_parse(list, &set) != NGX_OK) {
+            continue;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                ngx_cpu_nodes_map[cpu] = node;
+            }
+        }
+
+        if ((ngx_uint_t) node + 1 > ngx_nnodes) {
+            ngx_nnodes = node + 1;
+        }
+    }
+
+    closedir(dir);
+}
+
+
+static int
+ngx_cpu_cmp_core(const void *one, const void *two)
+{
+    const ngx_cpu_t  *a = one;
+    const ngx_cpu_t  *b = two;
+
+    if (a->package != b->package) {
+        return a->package - b->package;
+    }
+
+    if (a->core != b->core) {
+        return a->core - b->core;
+    }
+
+    return a->cpu - b->cpu;
+}
+
+#endif
@@ -0,0 +1,50 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_SETAFFINITY_H_INCLUDED_
+#define _NGX_SETAFFINITY_H_INCLUDED_
+
+
+#include "ngx_common.h"
+
+
+#if (NGX_HAVE_SCHED_SETAFFINITY)
+
+#define NGX_HAVE_CPU_AFFINITY 1
+
+#include <sched.h>
+
+typedef cpu_set_t  ngx_cpuset_t;
+
+
+typedef struct {
+    int                 cpu;
+    int                 node;
+    int                 package;
+    int                 core;
+    int                 smt;        /* rank of the cpu among its core siblings */
+    int                 core_rank;  /* rank of the core within its package */
+} ngx_cpu_t;
+
+
+/*
+ * the cpus the process may run on, with their NUMA node and package/core
+ * placement from sysfs; computed once, call it before starting threads
+ */
+ngx_cpu_t *ngx_cpu_topology(ngx_uint_t *n);
+ngx_uint_t ngx_cpu_nodes(void);
+int ngx_cpu_node(int cpu);
+
+/* NUMA node of the cpu the calling thread runs on */
+int ngx_current_node(void);
+
+/* "0,2,4-7" */
+ngx_int_t ngx_cpuset_parse(const char *list, ngx_cpuset_t *set);
+
+#endif
+
+
+#endif /* _NGX_SETAFFINITY_H_INCLUDED_ */
@@ -186,9 +186,28 @@ ngx_thread_mutex_unlock(ngx_thread_mutex_t *mtx)
 ngx_int_t
 ngx_thread_cond_create(ngx_thread_cond_t *cond)
 {
-    ngx_err_t  err;
+    ngx_err_t           err;
+    pthread_condattr_t  attr;
+
+    err = pthread_condattr_init(&attr);
+    if (err != 0) {
+        LOG_ERROR("pthread_condattr_init() failed");
+        return NGX_ERROR;
+    }
+
+    /* ngx_thread_cond_timedwait() timeouts are not affected by clock jumps */
+
+    err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (err != 0) {
+        LOG_ERROR("pthread_condattr_setclock() failed");
+        (void) pthread_condattr_destroy(&attr);
+        return NGX_ERROR;
+    }
+
+    err = pthread_cond_init(cond, &attr);
+
+    (void) pthread_condattr_destroy(&attr);
 
-    err = pthread_cond_init(cond, NULL);
     if (err == 0) {
         //ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
         //               "pthread_cond_init(%p)", cond);
@@ -240,6 +259,22 @@ ngx_thread_cond_signal(ngx_thread_cond_t *cond)
 }
 
 
+ngx_int_t
+ngx_thread_cond_broadcast(ngx_thread_cond_t *cond)
+{
+    ngx_err_t  err;
+
+    err = pthread_cond_broadcast(cond);
+    if (err == 0) {
+        LOG_DEBUG("pthread_cond_broadcast(%p)", cond);
+        return NGX_OK;
+    }
+
+    LOG_ERROR("pthread_cond_broadcast() failed");
+    return NGX_ERROR;
+}
+
+
 ngx_int_t
 ngx_thread_cond_wait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx)
 {
@@ -268,6 +303,274 @@ ngx_thread_cond_wait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx)
 }
 
 
+ngx_int_t
+ngx_thread_cond_timedwait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx,
+    ngx_msec_t timeout)
+{
+    ngx_err_t        err;
+    struct timespec  ts;
+
+    LOG_DEBUG("pthread_cond_timedwait(%p) enter", cond);
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000;
+
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    err = pthread_cond_timedwait(cond, mtx, &ts);
+
+    if (err == 0) {
+        LOG_DEBUG("pthread_cond_timedwait(%p) exit", cond);
+        return NGX_OK;
+    }
+
+    if (err == ETIMEDOUT) {
+        LOG_DEBUG("pthread_cond_timedwait(%p) timed out", cond);
+        return NGX_AGAIN;
+    }
+
+    LOG_ERROR("pthread_cond_timedwait() failed");
+    return NGX_ERROR;
+}
+
+
+//--------------ngx_monotonic_msec-----------
+
+ngx_msec_t
+ngx_monotonic_msec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ngx_msec_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+uint64_t
+ngx_monotonic_usec(void)
+{
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+//--------------ngx_thread_context-----------
+
+#if ( __amd64__ || __amd64 )
+
+/*
+ * pushes the callee saved registers onto the current stack, saves the
+ * stack pointer and pops the registers of the other context from its
+ * stack, the return address on it is where that context resumes
+ */
+
+__asm__ (
+    "    .text\n"
+    "    .p2align 4\n"
+    "    .globl ngx_thread_context_jump\n"
+    "    .type ngx_thread_context_jump, @function\n"
+    "ngx_thread_context_jump:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    "    .size ngx_thread_context_jump, .-ngx_thread_context_jump\n"
+);
+
+
+void
+ngx_thread_context_init(ngx_thread_context_t *ctx, u_char *stack,
+    size_t size, void (*entry)(void))
+{
+    void  **sp;
+
+    sp = (void **) (((uintptr_t) stack + size) & ~(uintptr_t) 15);
+
+    /*
+     * a null return address keeps entry's stack aligned as if called,
+     * below it the address to return to and six zeroed registers
+     */
+
+    *--sp = NULL;
+    *--sp = (void *) entry;
+
+    sp -= 6;
+    ngx_memzero(sp, 6 * sizeof(void *));
+
+    ctx->sp = sp;
+}
+
+#else
+
+void
+ngx_thread_context_init(ngx_thread_context_t *ctx, u_char *stack,
+    size_t size, void (*entry)(void))
+{
+    (void) getcontext(ctx);
+
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = size;
+    ctx->uc_link = NULL;
+
+    makecontext(ctx, entry, 0);
+}
+
+#endif
+
+
+//--------------ngx_futex-----------
+
+#if (NGX_HAVE_FUTEX)
+
+ngx_int_t
+ngx_futex_wait(volatile uint32_t *addr, uint32_t value, ngx_msec_t timeout)
+{
+    struct timespec   ts, *tsp;
+
+    tsp = NULL;
+
+    if (timeout) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, tsp, NULL, 0)
+        == 0)
+    {
+        return NGX_OK;
+    }
+
+    switch (errno) {
+
+    case ETIMEDOUT:
+        return NGX_AGAIN;
+
+    case EAGAIN:    /* *addr has already changed */
+    case EINTR:
+        return NGX_OK;
+
+    default:
+        LOG_ERROR("futex(FUTEX_WAIT) failed, errno %d", errno);
+        return NGX_ERROR;
+    }
+}
+
+
+void
+ngx_futex_wake(volatile uint32_t *addr, ngx_uint_t n)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, (int) n, NULL, NULL, 0)
+        == -1)
+    {
+        LOG_ERROR("futex(FUTEX_WAKE) failed, errno %d", errno);
+    }
+}
+
+
+
+void
+ngx_thread_latch_add(ngx_thread_latch_t *latch, ngx_uint_t n)
+{
+    (void) ngx_atomic_fetch_add(&latch->value, (uint32_t) n);
+}
+
+
+ngx_uint_t
+ngx_thread_latch_count_down(ngx_thread_latch_t *latch)
+{
+    uint32_t  old;
+
+    old = ngx_atomic_fetch_add(&latch->value, (uint32_t) -1);
+
+    if ((old & NGX_THREAD_LATCH_COUNT) != 1) {
+        return 0;
+    }
+
+    /* the latch may be gone already, a stray wake is harmless though */
+
+    if (old & NGX_THREAD_LATCH_WAITERS) {
+        ngx_futex_wake(&latch->value, NGX_THREAD_LATCH_COUNT);
+    }
+
+    return 1;
+}
+
+
+ngx_thread_wait_pt  ngx_thread_wait_handler;
+
+
+ngx_int_t
+ngx_thread_latch_wait(ngx_thread_latch_t *latch, ngx_msec_t timeout)
+{
+    uint32_t    value;
+    ngx_msec_t  deadline, wait;
+
+    deadline = ngx_monotonic_msec() + timeout;
+
+    for ( ;; ) {
+        value = ngx_atomic_load(&latch->value);
+
+        if ((value & NGX_THREAD_LATCH_COUNT) == 0) {
+            return NGX_OK;
+        }
+
+        /* a waiter that is not going to sleep leaves the bit alone */
+
+        if (timeout == NGX_TIMER_INFINITE) {
+            wait = 0;
+
+        } else {
+            wait = deadline - ngx_monotonic_msec();
+
+            if (timeout == 0 || (ngx_msec_int_t) wait <= 0) {
+                return NGX_AGAIN;
+            }
+        }
+
+        if (!(value & NGX_THREAD_LATCH_WAITERS)) {
+            if (!ngx_atomic_cmp_set(&latch->value, value,
+                                    value | NGX_THREAD_LATCH_WAITERS))
+            {
+                continue;
+            }
+
+            value |= NGX_THREAD_LATCH_WAITERS;
+        }
+
+        if (ngx_thread_wait_handler) {
+            ngx_thread_wait_handler();
+        }
+
+        if (ngx_futex_wait(&latch->value, value, wait) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+}
+
+#endif
+
+
 //--------------ngx_thread_tid-----------
 
 #if (NGX_LINUX)
@@ -5,6 +5,7 @@
 //#if (NGX_THREADS)
 
 #include "ngx_common.h"
+#include "ngx_atomic.h"
 
 typedef pthread_mutex_t  ngx_thread_mutex_t;
 
@@ -19,7 +20,92 @@ typedef pthread_cond_t  ngx_thread_cond_t;
 ngx_int_t ngx_thread_cond_create(ngx_thread_cond_t *cond);
 ngx_int_t ngx_thread_cond_destroy(ngx_thread_cond_t *cond);
 ngx_int_t ngx_thread_cond_signal(ngx_thread_cond_t *cond);
+ngx_int_t ngx_thread_cond_broadcast(ngx_thread_cond_t *cond);
 ngx_int_t ngx_thread_cond_wait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx);
+/* returns NGX_AGAIN on timeout */
+ngx_int_t ngx_thread_cond_timedwait(ngx_thread_cond_t *cond,
+    ngx_thread_mutex_t *mtx, ngx_msec_t timeout);
+
+ngx_msec_t ngx_monotonic_msec(void);
+uint64_t ngx_monotonic_usec(void);
+
+
+#if (NGX_HAVE_FUTEX)
+
+/*
+ * sleeps while *addr equals value, returns NGX_AGAIN on timeout,
+ * a zero timeout waits forever
+ */
+ngx_int_t ngx_futex_wait(volatile uint32_t *addr, uint32_t value,
+    ngx_msec_t timeout);
+void ngx_futex_wake(volatile uint32_t *addr, ngx_uint_t n);
+
+
+/*
+ * a countdown latch: waiters block until the count drops to zero, the
+ * wake syscall is only made if somebody waits
+ */
+
+typedef struct {
+    volatile uint32_t   value;
+} ngx_thread_latch_t;
+
+#define NGX_THREAD_LATCH_WAITERS  0x80000000
+#define NGX_THREAD_LATCH_COUNT    0x7fffffff
+
+#define ngx_thread_latch_init(latch, n)  (latch)->value = (n)
+#define ngx_thread_latch_done(latch)                                          \
+    ((ngx_atomic_load(&(latch)->value) & NGX_THREAD_LATCH_COUNT) == 0)
+
+void ngx_thread_latch_add(ngx_thread_latch_t *latch, ngx_uint_t n);
+/* returns 1 if the count has dropped to zero */
+ngx_uint_t ngx_thread_latch_count_down(ngx_thread_latch_t *latch);
+/* returns NGX_AGAIN on timeout, 0 polls, NGX_TIMER_INFINITE waits forever */
+ngx_int_t ngx_thread_latch_wait(ngx_thread_latch_t *latch,
+    ngx_msec_t timeout);
+
+/*
+ * called by ngx_thread_latch_wait() right before the thread sleeps, so a
+ * thread pool can hand work the waiter holds to other threads
+ */
+typedef void (*ngx_thread_wait_pt)(void);
+
+extern ngx_thread_wait_pt  ngx_thread_wait_handler;
+
+#endif
+
+
+/*
+ * an execution context on a stack of its own: ngx_thread_context_init()
+ * makes ctx start entry on the stack given, ngx_thread_context_switch()
+ * saves the current context in from and resumes to.  On amd64 only the
+ * callee saved registers are switched, elsewhere it is swapcontext(3),
+ * which also saves the signal mask.  entry must not return.
+ */
+
+#if ( __amd64__ || __amd64 )
+
+typedef struct {
+    void               *sp;
+} ngx_thread_context_t;
+
+void ngx_thread_context_jump(void **save, void *sp);
+
+#define ngx_thread_context_switch(from, to)                                   \
+    ngx_thread_context_jump(&(from)->sp, (to)->sp)
+
+#else
+
+#include <ucontext.h>
+
+typedef ucontext_t  ngx_thread_context_t;
+
+#define ngx_thread_context_switch(from, to)  (void) swapcontext(from, to)
+
+#endif
+
+void ngx_thread_context_init(ngx_thread_context_t *ctx, u_char *stack,
+    size_t size, void (*entry)(void));
 
 
 typedef pid_t      ngx_tid_t;
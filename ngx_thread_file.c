@@ -0,0 +1,742 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include "ngx_common.h"
+#include "ngx_atomic.h"
+#include "ngx_thread.h"
+#include "ngx_thread_pool.h"
+#include "ngx_thread_file.h"
+#include "flog.h"
+
+#include <sys/sendfile.h>
+#if (NGX_HAVE_IO_URING)
+#include <sys/mman.h>
+#endif
+
+
+/* the most iovecs one coalesced preadv() or pwritev() is given */
+
+#define NGX_THREAD_FILE_IOV  64
+
+
+#if (NGX_HAVE_IO_URING)
+
+typedef struct ngx_thread_file_uring_s  ngx_thread_file_uring_t;
+
+struct ngx_thread_file_uring_s {
+    ngx_thread_pool_t        *pool;
+    int                       fd;
+
+    /* submissions are serialized by lock, completions are run by poll */
+
+    ngx_atomic_t              lock;
+    ngx_atomic_t              inflight;
+    ngx_uint_t                max;
+
+    unsigned                 *sq_head;
+    unsigned                 *sq_tail;
+    unsigned                 *sq_mask;
+    unsigned                 *sq_array;
+    struct io_uring_sqe      *sqes;
+
+    unsigned                 *cq_head;
+    unsigned                 *cq_tail;
+    unsigned                 *cq_mask;
+    struct io_uring_cqe      *cqes;
+
+    ngx_thread_file_uring_t  *next;
+};
+
+#endif
+
+
+static ngx_int_t ngx_thread_file_post(ngx_thread_file_t *file, ngx_uint_t op,
+    struct iovec *iov, int niov, off_t offset, int out,
+    ngx_thread_file_handler_pt handler, void *data);
+static void ngx_thread_file_handler(void *data);
+static void ngx_thread_file_rw(ngx_thread_file_io_t *io);
+static void ngx_thread_file_complete(ngx_thread_task_t *task);
+#if (NGX_HAVE_IO_URING)
+static ngx_thread_file_uring_t *ngx_thread_file_uring_find(
+    ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_file_uring_start(ngx_thread_file_uring_t *ring,
+    ngx_thread_file_t *file, ngx_thread_task_t *task);
+static void ngx_thread_file_uring_next(ngx_thread_file_uring_t *ring,
+    ngx_thread_file_t *file);
+static ngx_int_t ngx_thread_file_uring_post(ngx_thread_file_uring_t *ring,
+    ngx_thread_task_t *task);
+static ngx_int_t ngx_thread_file_uring_poll(void *data);
+#endif
+
+
+#if (NGX_HAVE_IO_URING)
+
+/* rings live until exit, like the pools they are set up for */
+
+static ngx_thread_file_uring_t  *ngx_thread_file_urings;
+
+#endif
+
+
+void
+ngx_thread_file_init(ngx_thread_file_t *file, ngx_thread_pool_t *tp, int fd)
+{
+    file->fd = fd;
+
+    ngx_thread_strand_init(&file->strand, tp);
+}
+
+
+ngx_int_t
+ngx_thread_file_read(ngx_thread_file_t *file, u_char *buf, size_t size,
+    off_t offset, ngx_thread_file_handler_pt handler, void *data)
+{
+    struct iovec  iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    return ngx_thread_file_post(file, NGX_THREAD_FILE_READ, &iov, 1, offset,
+                                -1, handler, data);
+}
+
+
+ngx_int_t
+ngx_thread_file_write(ngx_thread_file_t *file, u_char *buf, size_t size,
+    off_t offset, ngx_thread_file_handler_pt handler, void *data)
+{
+    struct iovec  iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    return ngx_thread_file_post(file, NGX_THREAD_FILE_WRITE, &iov, 1, offset,
+                                -1, handler, data);
+}
+
+
+ngx_int_t
+ngx_thread_file_readv(ngx_thread_file_t *file, struct iovec *iov, int niov,
+    off_t offset, ngx_thread_file_handler_pt handler, void *data)
+{
+    return ngx_thread_file_post(file, NGX_THREAD_FILE_READ, iov, niov, offset,
+                                -1, handler, data);
+}
+
+
+ngx_int_t
+ngx_thread_file_writev(ngx_thread_file_t *file, struct iovec *iov, int niov,
+    off_t offset, ngx_thread_file_handler_pt handler, void *data)
+{
+    return ngx_thread_file_post(file, NGX_THREAD_FILE_WRITE, iov, niov,
+                                offset, -1, handler, data);
+}
+
+
+ngx_int_t
+ngx_thread_file_fsync(ngx_thread_file_t *file,
+    ngx_thread_file_handler_pt handler, void *data)
+{
+    return ngx_thread_file_post(file, NGX_THREAD_FILE_FSYNC, NULL, 0, 0, -1,
+                                handler, data);
+}
+
+
+ngx_int_t
+ngx_thread_file_sendfile(ngx_thread_file_t *file, int out, off_t offset,
+    size_t size, ngx_thread_file_handler_pt handler, void *data)
+{
+    struct iovec  iov;
+
+    iov.iov_base = NULL;
+    iov.iov_len = size;
+
+    return ngx_thread_file_post(file, NGX_THREAD_FILE_SENDFILE, &iov, 1,
+                                offset, out, handler, data);
+}
+
+
+static ngx_int_t
+ngx_thread_file_post(ngx_thread_file_t *file, ngx_uint_t op,
+    struct iovec *iov, int niov, off_t offset, int out,
+    ngx_thread_file_handler_pt handler, void *data)
+{
+    int                       i;
+    ngx_thread_task_t        *task;
+    ngx_thread_file_io_t     *io;
+#if (NGX_HAVE_IO_URING)
+    ngx_thread_file_uring_t  *ring;
+#endif
+
+    task = ngx_thread_task_alloc(file->strand.pool,
+                                 sizeof(ngx_thread_file_io_t));
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    io = task->ctx;
+
+    io->op = op;
+    io->file = file;
+    io->offset = offset;
+    io->out = out;
+    io->handler = handler;
+    io->data = data;
+
+    /* a single buffer is kept in the request, the caller's iov may go */
+
+    if (niov == 1) {
+        io->buf = iov[0];
+        io->iov = &io->buf;
+
+    } else {
+        io->iov = iov;
+    }
+
+    io->niov = niov;
+
+    for (i = 0; i < niov; i++) {
+        io->size += iov[i].iov_len;
+    }
+
+    task->handler = ngx_thread_file_handler;
+    task->complete = ngx_thread_file_complete;
+
+#if (NGX_HAVE_IO_URING)
+
+    if (op != NGX_THREAD_FILE_SENDFILE) {
+        ring = ngx_thread_file_uring_find(file->strand.pool);
+
+        if (ring && ngx_thread_file_uring_start(ring, file, task) == NGX_OK) {
+            return NGX_OK;
+        }
+    }
+
+#endif
+
+    if (ngx_thread_strand_post(&file->strand, task) != NGX_OK) {
+        ngx_thread_task_free(task);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_file_handler(void *data)
+{
+    ngx_thread_file_io_t *io = data;
+
+    off_t  offset;
+
+    switch (io->op) {
+
+    case NGX_THREAD_FILE_READ:
+    case NGX_THREAD_FILE_WRITE:
+        ngx_thread_file_rw(io);
+        return;
+
+    case NGX_THREAD_FILE_FSYNC:
+        io->result = fsync(io->file->fd);
+        break;
+
+    default: /* NGX_THREAD_FILE_SENDFILE */
+        offset = io->offset;
+        io->result = sendfile(io->out, io->file->fd, &offset, io->size);
+        break;
+    }
+
+    io->err = (io->result == -1) ? errno : 0;
+}
+
+
+/*
+ * claims the reads or writes queued right behind io on the file's strand
+ * that continue where the previous one ends, and does them all with one
+ * syscall; a short transfer is shared out in request order
+ */
+
+static void
+ngx_thread_file_rw(ngx_thread_file_io_t *io)
+{
+    int                    n;
+    off_t                  end;
+    size_t                 size;
+    ssize_t                rc, left;
+    ngx_err_t              err;
+    ngx_uint_t             i, nios;
+    struct iovec           iov[NGX_THREAD_FILE_IOV], *piov;
+    ngx_thread_task_t     *task;
+    ngx_thread_strand_t   *strand;
+    ngx_thread_file_io_t  *next, *ios[NGX_THREAD_FILE_IOV];
+
+    strand = &io->file->strand;
+
+    ios[0] = io;
+    nios = 1;
+
+    n = io->niov;
+    end = io->offset + io->size;
+
+    if (n < NGX_THREAD_FILE_IOV) {
+        memcpy(iov, io->iov, n * sizeof(struct iovec));
+
+        ngx_spinlock(&strand->lock, 1, 2048);
+
+        for (task = strand->first; task; task = task->next) {
+            next = task->ctx;
+
+            if (next->op != io->op
+                || next->offset != end
+                || nios == NGX_THREAD_FILE_IOV
+                || n + next->niov > NGX_THREAD_FILE_IOV
+                || ngx_thread_task_claim(task) != NGX_OK)
+            {
+                break;
+            }
+
+            memcpy(&iov[n], next->iov, next->niov * sizeof(struct iovec));
+
+            n += next->niov;
+            end += next->size;
+            ios[nios++] = next;
+        }
+
+        ngx_unlock(&strand->lock);
+    }
+
+    piov = (nios == 1) ? io->iov : iov;
+
+    if (io->op == NGX_THREAD_FILE_READ) {
+        rc = preadv(io->file->fd, piov, n, io->offset);
+
+    } else {
+        rc = pwritev(io->file->fd, piov, n, io->offset);
+    }
+
+    err = (rc == -1) ? errno : 0;
+    left = rc;
+
+    for (i = 0; i < nios; i++) {
+        next = ios[i];
+
+        if (rc == -1) {
+            next->result = -1;
+            next->err = err;
+            continue;
+        }
+
+        size = ((size_t) left < next->size) ? (size_t) left : next->size;
+
+        next->result = size;
+        next->err = 0;
+
+        left -= size;
+    }
+}
+
+
+static void
+ngx_thread_file_complete(ngx_thread_task_t *task)
+{
+    ngx_thread_file_io_t *io = task->ctx;
+
+    if (task->status != NGX_THREAD_TASK_DONE) {
+        io->result = -1;
+        io->err = ECANCELED;
+    }
+
+    io->handler(io);
+}
+
+
+#if (NGX_HAVE_IO_URING)
+
+ngx_int_t
+ngx_thread_file_uring(ngx_thread_pool_t *tp, ngx_uint_t entries)
+{
+    int                       fd, notify;
+    size_t                    sq_size, cq_size;
+    u_char                   *sq, *cq;
+    struct io_uring_sqe      *sqes;
+    struct io_uring_params    p;
+    ngx_thread_file_uring_t  *ring;
+
+    notify = ngx_thread_pool_notify_fd(tp);
+
+    if (notify == -1) {
+        LOG_ERROR("io_uring needs a started thread pool with an eventfd");
+        return NGX_ERROR;
+    }
+
+    ring = ngx_thread_file_uring_find(tp);
+
+    if (ring) {
+        /* the pool was started again with a new eventfd */
+
+        (void) syscall(SYS_io_uring_register, ring->fd,
+                       IORING_UNREGISTER_EVENTFD, NULL, 0);
+
+        goto notify;
+    }
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    fd = syscall(SYS_io_uring_setup, entries, &p);
+
+    if (fd == -1) {
+        LOG_WARN("io_uring_setup() failed, errno %d, "
+                 "file I/O stays on threads", errno);
+        return NGX_DECLINED;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) {
+            sq_size = cq_size;
+        }
+
+        cq_size = sq_size;
+    }
+
+    sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              fd, IORING_OFF_SQ_RING);
+
+    if (sq == MAP_FAILED) {
+        LOG_ERROR("mmap() of io_uring failed, errno %d", errno);
+        (void) close(fd);
+        return NGX_ERROR;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+
+    } else {
+        cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+        if (cq == MAP_FAILED) {
+            LOG_ERROR("mmap() of io_uring failed, errno %d", errno);
+            (void) munmap(sq, sq_size);
+            (void) close(fd);
+            return NGX_ERROR;
+        }
+    }
+
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                fd, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED) {
+        LOG_ERROR("mmap() of io_uring failed, errno %d", errno);
+        goto failed;
+    }
+
+    ring = calloc(1, sizeof(ngx_thread_file_uring_t));
+    if (ring == NULL) {
+        LOG_ERROR("calloc() failed");
+        (void) munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        goto failed;
+    }
+
+    ring->pool = tp;
+    ring->fd = fd;
+
+    /* the completion queue never overflows */
+
+    ring->max = p.cq_entries;
+
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->sqes = sqes;
+
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    ngx_thread_pool_set_poll(tp, ngx_thread_file_uring_poll, ring);
+
+    ring->next = ngx_thread_file_urings;
+    ngx_thread_file_urings = ring;
+
+notify:
+
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD,
+                &notify, 1)
+        == -1)
+    {
+        LOG_ERROR("io_uring_register() failed, errno %d", errno);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if (cq != sq) {
+        (void) munmap(cq, cq_size);
+    }
+
+    (void) munmap(sq, sq_size);
+    (void) close(fd);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_thread_file_uring_t *
+ngx_thread_file_uring_find(ngx_thread_pool_t *tp)
+{
+    ngx_thread_file_uring_t  *ring;
+
+    for (ring = ngx_thread_file_urings; ring; ring = ring->next) {
+        if (ring->pool == tp) {
+            return ring;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * a file is either on the ring or on its strand: the ring only takes an
+ * operation while the strand is idle, and keeps the strand busy until the
+ * operation completes, so the ones posted meanwhile queue up on the strand
+ * in order, and ngx_thread_file_uring_next() moves them on one at a time
+ */
+
+static ngx_int_t
+ngx_thread_file_uring_start(ngx_thread_file_uring_t *ring,
+    ngx_thread_file_t *file, ngx_thread_task_t *task)
+{
+    ngx_thread_strand_t  *strand;
+
+    strand = &file->strand;
+
+    ngx_spinlock(&strand->lock, 1, 2048);
+
+    if (strand->busy) {
+        ngx_unlock(&strand->lock);
+        return NGX_DECLINED;
+    }
+
+    strand->busy = 1;
+
+    ngx_unlock(&strand->lock);
+
+    if (ngx_thread_file_uring_post(ring, task) != NGX_OK) {
+        ngx_thread_strand_resume(strand, task);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * called once an operation of the file has completed on the ring: the
+ * next one is submitted as well, unless it is a sendfile, or has been
+ * cancelled, or the ring is full, then workers run the rest of the strand.
+ * This runs on the thread processing completions, which must not wait for
+ * room in the queue: a strand that does not fit is left pending in the
+ * pool, and workers queue it as they make room, see ngx_thread_pool.c
+ */
+
+static void
+ngx_thread_file_uring_next(ngx_thread_file_uring_t *ring,
+    ngx_thread_file_t *file)
+{
+    ngx_thread_task_t     *task;
+    ngx_thread_strand_t   *strand;
+    ngx_thread_file_io_t  *io;
+
+    strand = &file->strand;
+
+    ngx_spinlock(&strand->lock, 1, 2048);
+
+    task = strand->first;
+
+    if (task == NULL) {
+        strand->busy = 0;
+        ngx_unlock(&strand->lock);
+        return;
+    }
+
+    io = task->ctx;
+
+    if (io->op == NGX_THREAD_FILE_SENDFILE
+        || ngx_thread_task_claim(task) != NGX_OK)
+    {
+        ngx_unlock(&strand->lock);
+        ngx_thread_strand_resume(strand, NULL);
+        return;
+    }
+
+    strand->first = task->next;
+
+    if (strand->first == NULL) {
+        strand->last = &strand->first;
+    }
+
+    ngx_unlock(&strand->lock);
+
+    task->next = NULL;
+
+    if (ngx_thread_file_uring_post(ring, task) != NGX_OK) {
+        ngx_thread_strand_resume(strand, task);
+    }
+}
+
+
+/*
+ * submits the operation right away, returns NGX_DECLINED for the caller
+ * to run it on a thread if the ring is full or the submission fails
+ */
+
+static ngx_int_t
+ngx_thread_file_uring_post(ngx_thread_file_uring_t *ring,
+    ngx_thread_task_t *task)
+{
+    int                    rc;
+    unsigned               tail, index;
+    ngx_err_t              err;
+    struct io_uring_sqe   *sqe;
+    ngx_thread_file_io_t  *io;
+
+    io = task->ctx;
+
+    if (ngx_atomic_fetch_add(&ring->inflight, 1) >= ring->max) {
+        (void) ngx_atomic_fetch_add(&ring->inflight, -1);
+        return NGX_DECLINED;
+    }
+
+    ngx_spinlock(&ring->lock, 1, 2048);
+
+    tail = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+
+    sqe = &ring->sqes[index];
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    switch (io->op) {
+
+    case NGX_THREAD_FILE_READ:
+        sqe->opcode = IORING_OP_READV;
+        break;
+
+    case NGX_THREAD_FILE_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        break;
+
+    default: /* NGX_THREAD_FILE_FSYNC */
+        sqe->opcode = IORING_OP_FSYNC;
+        break;
+    }
+
+    sqe->fd = io->file->fd;
+
+    if (io->op != NGX_THREAD_FILE_FSYNC) {
+        sqe->addr = (uintptr_t) io->iov;
+        sqe->len = io->niov;
+        sqe->off = io->offset;
+    }
+
+    sqe->user_data = (uintptr_t) task;
+
+    ring->sq_array[index] = index;
+
+    ngx_atomic_store(ring->sq_tail, tail + 1);
+
+    do {
+        rc = syscall(SYS_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    } while (rc == -1 && errno == EINTR);
+
+    err = errno;
+
+    if (rc != 1 && ngx_atomic_load(ring->sq_head) == tail) {
+
+        /* the kernel has not taken the entry, so it is taken back */
+
+        ngx_atomic_store(ring->sq_tail, tail);
+
+        ngx_unlock(&ring->lock);
+
+        (void) ngx_atomic_fetch_add(&ring->inflight, -1);
+
+        LOG_ERROR("io_uring_enter() failed, errno %d", rc == -1 ? err : 0);
+
+        return NGX_DECLINED;
+    }
+
+    ngx_unlock(&ring->lock);
+
+    return NGX_OK;
+}
+
+
+/* runs in ngx_thread_pool_process_completions(), the only consumer */
+
+static ngx_int_t
+ngx_thread_file_uring_poll(void *data)
+{
+    ngx_thread_file_uring_t *ring = data;
+
+    int                    res;
+    unsigned               head;
+    ngx_int_t              n;
+    struct io_uring_cqe   *cqe;
+    ngx_thread_task_t     *task;
+    ngx_thread_file_io_t  *io;
+
+    n = 0;
+
+    head = *ring->cq_head;
+
+    while (head != ngx_atomic_load(ring->cq_tail)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+
+        task = (ngx_thread_task_t *) (uintptr_t) cqe->user_data;
+        res = cqe->res;
+
+        /* the entry is given back before the handler may submit more */
+
+        ngx_atomic_store(ring->cq_head, ++head);
+        (void) ngx_atomic_fetch_add(&ring->inflight, -1);
+
+        io = task->ctx;
+
+        if (res < 0) {
+            io->result = -1;
+            io->err = -res;
+
+        } else {
+            io->result = res;
+            io->err = 0;
+        }
+
+        task->status = NGX_THREAD_TASK_DONE;
+
+        /* the handler may close the file, so it is moved on before */
+
+        ngx_thread_file_uring_next(ring, io->file);
+
+        io->handler(io);
+
+        ngx_thread_task_free(task);
+
+        n++;
+    }
+
+    return n;
+}
+
+#endif
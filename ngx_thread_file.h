@@ -0,0 +1,105 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_THREAD_FILE_H_INCLUDED_
+#define _NGX_THREAD_FILE_H_INCLUDED_
+
+
+#include "ngx_common.h"
+#include "ngx_thread_pool.h"
+
+#include <sys/uio.h>
+
+
+#define NGX_THREAD_FILE_READ      0
+#define NGX_THREAD_FILE_WRITE     1
+#define NGX_THREAD_FILE_FSYNC     2
+#define NGX_THREAD_FILE_SENDFILE  3
+
+
+/*
+ * Operations on a file run on the pool one at a time in the order they
+ * were posted, on the file's strand.  A read or write that finds more
+ * reads or writes queued right behind it, each starting where the
+ * previous one ends, does them all with one preadv() or pwritev().  The
+ * result of every operation is reported to its handler from
+ * ngx_thread_pool_process_completions(): io->result is the number of
+ * bytes done, or -1 with io->err set, ECANCELED if the operation was
+ * skipped.  Buffers, and the iovec arrays of readv and writev, must stay
+ * valid until then.  If posting fails, NGX_ERROR is returned and the
+ * handler is not called.
+ */
+
+typedef struct {
+    int                          fd;
+    ngx_thread_strand_t          strand;
+} ngx_thread_file_t;
+
+typedef struct ngx_thread_file_io_s  ngx_thread_file_io_t;
+
+typedef void (*ngx_thread_file_handler_pt)(ngx_thread_file_io_t *io);
+
+struct ngx_thread_file_io_s {
+    ngx_uint_t                   op;
+    ngx_thread_file_t           *file;
+    off_t                        offset;
+    struct iovec                *iov;
+    int                          niov;
+    size_t                       size;
+    int                          out; //sendfile() target
+    struct iovec                 buf;
+
+    ssize_t                      result;
+    ngx_err_t                    err;
+
+    ngx_thread_file_handler_pt   handler;
+    void                        *data;
+};
+
+
+void ngx_thread_file_init(ngx_thread_file_t *file, ngx_thread_pool_t *tp,
+    int fd);
+
+ngx_int_t ngx_thread_file_read(ngx_thread_file_t *file, u_char *buf,
+    size_t size, off_t offset, ngx_thread_file_handler_pt handler,
+    void *data);
+ngx_int_t ngx_thread_file_write(ngx_thread_file_t *file, u_char *buf,
+    size_t size, off_t offset, ngx_thread_file_handler_pt handler,
+    void *data);
+ngx_int_t ngx_thread_file_readv(ngx_thread_file_t *file, struct iovec *iov,
+    int niov, off_t offset, ngx_thread_file_handler_pt handler, void *data);
+ngx_int_t ngx_thread_file_writev(ngx_thread_file_t *file, struct iovec *iov,
+    int niov, off_t offset, ngx_thread_file_handler_pt handler, void *data);
+ngx_int_t ngx_thread_file_fsync(ngx_thread_file_t *file,
+    ngx_thread_file_handler_pt handler, void *data);
+
+/* sends size bytes of the file from offset to the out fd */
+ngx_int_t ngx_thread_file_sendfile(ngx_thread_file_t *file, int out,
+    off_t offset, size_t size, ngx_thread_file_handler_pt handler,
+    void *data);
+
+#if (NGX_HAVE_IO_URING)
+
+/*
+ * sets up an io_uring of the given number of entries for the files of a
+ * started pool: reads, writes and fsyncs are then submitted to the kernel
+ * from the posting thread instead of being run by workers, and complete
+ * through the pool's notify eventfd and completion handlers as before.
+ * Operations on a file still run one at a time in the order they were
+ * posted: a file has one operation on the ring at most, the next one is
+ * submitted when it completes.  sendfile, operations behind it, and those
+ * posted while the ring has as many in flight as its completion queue
+ * can hold run on the file's strand, and the file returns to the ring
+ * once its strand is idle.  Returns NGX_DECLINED if the kernel has no
+ * io_uring, file I/O then keeps using the pool's threads.  A pool that is
+ * shut down and started again needs another call to use its ring.
+ */
+ngx_int_t ngx_thread_file_uring(ngx_thread_pool_t *tp, ngx_uint_t entries);
+
+#endif
+
+
+#endif /* _NGX_THREAD_FILE_H_INCLUDED_ */
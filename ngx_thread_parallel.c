@@ -0,0 +1,267 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include "ngx_common.h"
+#include "ngx_atomic.h"
+#include "ngx_thread.h"
+#include "ngx_thread_pool.h"
+#include "ngx_thread_parallel.h"
+#include "flog.h"
+
+
+#if (NGX_HAVE_FUTEX)
+
+/*
+ * The job is shared by the caller and the helper tasks, and freed by
+ * whoever drops the last reference: a helper that starts after the range
+ * is done finds nothing to do, but still has to see the job.  The caller
+ * waits on the latch, which the participant that accounts for the last
+ * items releases after merging its accumulator.
+ */
+
+typedef struct {
+    ngx_atomic_t              cursor;
+    ngx_uint_t                end;
+    ngx_uint_t                grain;
+    ngx_uint_t                participants;
+
+    ngx_thread_range_pt       range;
+    ngx_thread_reduce_pt      reduce;
+    ngx_thread_join_pt        join;
+    void                     *ctx;
+    void                     *result;
+    size_t                    size;
+
+    ngx_atomic_t              remaining;
+    ngx_atomic_t              refs;
+    ngx_atomic_t              lock;
+    ngx_thread_latch_t        latch;
+
+    u_char                   *identity;
+    u_char                   *acc;
+} ngx_thread_parallel_job_t;
+
+
+#define ngx_thread_parallel_acc(ctx)  ((u_char *) (ctx) + 16)
+
+
+static ngx_int_t ngx_thread_pool_parallel(ngx_thread_pool_t *tp,
+    ngx_thread_parallel_job_t *job, ngx_uint_t begin);
+static void ngx_thread_parallel_handler(void *data);
+static void ngx_thread_parallel_run(ngx_thread_parallel_job_t *job,
+    void *acc);
+static void ngx_thread_parallel_unref(ngx_thread_parallel_job_t *job);
+
+
+ngx_int_t
+ngx_thread_pool_parallel_for(ngx_thread_pool_t *tp, ngx_uint_t begin,
+    ngx_uint_t end, ngx_uint_t grain, ngx_thread_range_pt fn, void *ctx)
+{
+    ngx_thread_parallel_job_t  *job;
+
+    if (begin >= end) {
+        return NGX_OK;
+    }
+
+    job = calloc(1, sizeof(ngx_thread_parallel_job_t));
+    if (job == NULL) {
+        LOG_ERROR("calloc() failed");
+        return NGX_ERROR;
+    }
+
+    job->end = end;
+    job->grain = grain ? grain : 1;
+    job->range = fn;
+    job->ctx = ctx;
+
+    return ngx_thread_pool_parallel(tp, job, begin);
+}
+
+
+ngx_int_t
+ngx_thread_pool_parallel_reduce(ngx_thread_pool_t *tp, ngx_uint_t begin,
+    ngx_uint_t end, ngx_uint_t grain, ngx_thread_reduce_pt fn,
+    ngx_thread_join_pt join, void *ctx, void *result, size_t size)
+{
+    ngx_thread_parallel_job_t  *job;
+
+    if (begin >= end) {
+        return NGX_OK;
+    }
+
+    job = calloc(1, sizeof(ngx_thread_parallel_job_t) + 2 * size);
+    if (job == NULL) {
+        LOG_ERROR("calloc() failed");
+        return NGX_ERROR;
+    }
+
+    job->end = end;
+    job->grain = grain ? grain : 1;
+    job->reduce = fn;
+    job->join = join;
+    job->ctx = ctx;
+    job->result = result;
+    job->size = size;
+
+    job->identity = (u_char *) job + sizeof(ngx_thread_parallel_job_t);
+    job->acc = job->identity + size;
+
+    memcpy(job->identity, result, size);
+    memcpy(job->acc, result, size);
+
+    return ngx_thread_pool_parallel(tp, job, begin);
+}
+
+
+static ngx_int_t
+ngx_thread_pool_parallel(ngx_thread_pool_t *tp, ngx_thread_parallel_job_t *job,
+    ngx_uint_t begin)
+{
+    ngx_uint_t          i, n, chunks;
+    ngx_thread_task_t  *task, *first;
+
+    job->cursor = begin;
+    job->remaining = job->end - begin;
+
+    ngx_thread_latch_init(&job->latch, 1);
+
+    /* no more helpers than chunks to share with the calling thread */
+
+    chunks = (job->end - begin + job->grain - 1) / job->grain;
+
+    n = ngx_thread_pool_threads(tp);
+
+    if (n > chunks - 1) {
+        n = chunks - 1;
+    }
+
+    first = NULL;
+
+    for (i = 0; i < n; i++) {
+        task = ngx_thread_task_alloc(tp, 16 + job->size);
+        if (task == NULL) {
+            break;
+        }
+
+        *(ngx_thread_parallel_job_t **) task->ctx = job;
+
+        if (job->size) {
+            memcpy(ngx_thread_parallel_acc(task->ctx), job->identity,
+                   job->size);
+        }
+
+        task->handler = ngx_thread_parallel_handler;
+        task->next = first;
+        first = task;
+    }
+
+    n = i;
+
+    job->participants = n + 1;
+    job->refs = n + 1;
+
+    if (first && ngx_thread_task_post_chain(tp, first) != NGX_OK) {
+
+        /* the queue is full, the calling thread does it all */
+
+        while (first) {
+            task = first;
+            first = task->next;
+            ngx_thread_task_free(task);
+        }
+
+        job->participants = 1;
+        job->refs = 1;
+    }
+
+    ngx_thread_parallel_run(job, job->acc);
+
+    (void) ngx_thread_latch_wait(&job->latch, NGX_TIMER_INFINITE);
+
+    ngx_thread_parallel_unref(job);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_parallel_handler(void *data)
+{
+    ngx_thread_parallel_job_t  *job = *(ngx_thread_parallel_job_t **) data;
+
+    ngx_thread_parallel_run(job, ngx_thread_parallel_acc(data));
+
+    ngx_thread_parallel_unref(job);
+}
+
+
+static void
+ngx_thread_parallel_run(ngx_thread_parallel_job_t *job, void *acc)
+{
+    ngx_uint_t  b, n, done;
+
+    done = 0;
+
+    for ( ;; ) {
+        b = job->cursor;
+
+        if (b >= job->end) {
+            break;
+        }
+
+        /* guided: a share of what is left, but at least grain items */
+
+        n = (job->end - b) / (2 * job->participants);
+
+        if (n < job->grain) {
+            n = job->grain;
+        }
+
+        if (n > job->end - b) {
+            n = job->end - b;
+        }
+
+        if (!ngx_atomic_cmp_set(&job->cursor, b, b + n)) {
+            continue;
+        }
+
+        if (job->reduce) {
+            job->reduce(job->ctx, b, b + n, acc);
+
+        } else {
+            job->range(job->ctx, b, b + n);
+        }
+
+        done += n;
+    }
+
+    if (done == 0) {
+        return;
+    }
+
+    if (job->join) {
+        ngx_spinlock(&job->lock, 1, 2048);
+
+        job->join(job->ctx, job->result, acc);
+
+        ngx_unlock(&job->lock);
+    }
+
+    if (ngx_atomic_fetch_add(&job->remaining, -done) == done) {
+        (void) ngx_thread_latch_count_down(&job->latch);
+    }
+}
+
+
+static void
+ngx_thread_parallel_unref(ngx_thread_parallel_job_t *job)
+{
+    if (ngx_atomic_fetch_add(&job->refs, -1) == 1) {
+        free(job);
+    }
+}
+
+#endif
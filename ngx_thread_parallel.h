@@ -0,0 +1,48 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_THREAD_PARALLEL_H_INCLUDED_
+#define _NGX_THREAD_PARALLEL_H_INCLUDED_
+
+
+#include "ngx_common.h"
+#include "ngx_thread_pool.h"
+
+
+#if (NGX_HAVE_FUTEX)
+
+typedef void (*ngx_thread_range_pt)(void *ctx, ngx_uint_t begin,
+    ngx_uint_t end);
+typedef void (*ngx_thread_reduce_pt)(void *ctx, ngx_uint_t begin,
+    ngx_uint_t end, void *acc);
+typedef void (*ngx_thread_join_pt)(void *ctx, void *acc, void *partial);
+
+
+/*
+ * calls fn for chunks of [begin, end) on the pool's workers and the
+ * calling thread, and returns when the whole range is done.  Chunks are
+ * taken from a shared cursor, large first and shrinking as the range runs
+ * out, but never smaller than grain items.
+ */
+ngx_int_t ngx_thread_pool_parallel_for(ngx_thread_pool_t *tp,
+    ngx_uint_t begin, ngx_uint_t end, ngx_uint_t grain,
+    ngx_thread_range_pt fn, void *ctx);
+
+/*
+ * the same for a reduction: *result holds the identity of join on entry,
+ * each participant accumulates its chunks with fn into its own size bytes
+ * copy of it, and the copies are merged into *result with join, one
+ * participant at a time
+ */
+ngx_int_t ngx_thread_pool_parallel_reduce(ngx_thread_pool_t *tp,
+    ngx_uint_t begin, ngx_uint_t end, ngx_uint_t grain,
+    ngx_thread_reduce_pt fn, ngx_thread_join_pt join, void *ctx,
+    void *result, size_t size);
+
+#endif
+
+
+#endif /* _NGX_THREAD_PARALLEL_H_INCLUDED_ */
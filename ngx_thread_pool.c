@@ -2,8 +2,11 @@
 #include "ngx_atomic.h"
 #include "ngx_thread.h"
 #include "ngx_thread_pool.h"
+#include "ngx_setaffinity.h"
 #include "flog.h"
 
+#include <sys/mman.h>
+
 
 typedef struct {
     ngx_thread_task_t        *first;
@@ -15,411 +18,5566 @@ typedef struct {
     (q)->last = &(q)->first
 
 
+/*
+ * The "ring" queue engine is a bounded MPMC ring of sequence-numbered
+ * cells: producers and workers claim positions with a single CAS on
+ * tail and head respectively, so the fast path never touches tp->mtx.
+ * The mutex and the condition variable are only used to park workers
+ * when the ring is empty.
+ */
+
+typedef struct {
+    ngx_atomic_t              seq;
+    ngx_thread_task_t        *task;
+} ngx_thread_pool_cell_t;
+
+typedef struct {
+    ngx_thread_pool_cell_t   *cells;
+    ngx_uint_t                mask;
+
+    u_char                    pad0[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              tail;
+    u_char                    pad1[NGX_CPU_CACHE_LINE - sizeof(ngx_atomic_t)];
+    ngx_atomic_t              head;
+    u_char                    pad2[NGX_CPU_CACHE_LINE - sizeof(ngx_atomic_t)];
+} ngx_thread_pool_ring_t;
+
+
+/*
+ * The "steal" queue engine gives every worker a Chase-Lev deque, which
+ * only the owner pushes to and pops from its bottom while other workers
+ * steal from its top, and a spinlock protected inbox for tasks posted
+ * from outside the pool.  Producers spread posts over the inboxes, and
+ * a worker moves its inbox into its deque in one go, so that idle
+ * workers can steal from it.
+ */
+
+typedef struct {
+    ngx_thread_task_t       **buf;
+    ngx_uint_t                mask;
+
+    u_char                    pad0[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              top;
+    u_char                    pad1[NGX_CPU_CACHE_LINE - sizeof(ngx_atomic_t)];
+    ngx_atomic_t              bottom;
+    u_char                    pad2[NGX_CPU_CACHE_LINE - sizeof(ngx_atomic_t)];
+} ngx_thread_pool_deque_t;
+
+
+/*
+ * Tasks of ngx_thread_task_alloc() come from per pool slabs, one per
+ * size class of the inline ctx.  Every thread keeps a cache of free
+ * tasks for each slab it uses, and moves them to and from the slab's
+ * depot a batch at a time under a spinlock, so neither allocation nor
+ * free of a task goes to the heap or takes a lock on the fast path.
+ * Free tasks in the depot are chained by task->next within a batch,
+ * by task->ctx between batches, and the first task of a batch keeps
+ * the batch size in task->id.  Slab memory is never freed, as pools
+ * live until the process exits.
+ */
+
+#define NGX_THREAD_TASK_SLABS        5       /* 64 .. 1024 bytes of ctx */
+#define NGX_THREAD_TASK_SLAB_BATCH   32
+#define NGX_THREAD_TASK_CACHES       16      /* slabs cached per thread */
+
+typedef struct {
+    ngx_atomic_t              lock;
+    ngx_thread_task_t        *depot;
+    size_t                    size;
+    ngx_uint_t                index;
+} ngx_thread_task_slab_t;
+
+typedef struct {
+    ngx_thread_task_slab_t   *slab;
+    ngx_thread_task_t        *free;
+    ngx_uint_t                nfree;
+} ngx_thread_task_cache_t;
+
+#define ngx_thread_task_header                                                \
+    ((sizeof(ngx_thread_task_t) + 15) & ~((size_t) 15))
+
+
+/*
+ * a posted task is queued until a worker starts it or it is cancelled,
+ * whoever changes the state first wins
+ */
+
+#define NGX_THREAD_TASK_QUEUED          0
+#define NGX_THREAD_TASK_STARTED         1
+#define NGX_THREAD_TASK_WITHDRAWN       2
+
+/* the task of a strand, which a worker runs the strand's tasks for */
+
+#define NGX_THREAD_TASK_STRAND          3
+
+#define NGX_THREAD_STRAND_BATCH         32
+
+/* the task that resumes a fiber, see ngx_thread_fiber_t */
+
+#define NGX_THREAD_TASK_FIBER           4
+
+#define NGX_THREAD_FIBER_RUNNING        0
+#define NGX_THREAD_FIBER_WAITING        1
+#define NGX_THREAD_FIBER_DONE           2
+
+#define NGX_THREAD_FIBER_STACK          (128 * 1024)
+
+
+#define NGX_THREAD_POOL_LIFO_RUNS       16
+
+
+#define NGX_THREAD_POOL_WORKER_FREE     0
+#define NGX_THREAD_POOL_WORKER_RUNNING  1
+#define NGX_THREAD_POOL_WORKER_LEAVING  2
+#define NGX_THREAD_POOL_WORKER_EXITED   3
+
+
+#define NGX_THREAD_POOL_AFFINITY_NONE     0
+#define NGX_THREAD_POOL_AFFINITY_COMPACT  1
+#define NGX_THREAD_POOL_AFFINITY_SCATTER  2
+#define NGX_THREAD_POOL_AFFINITY_NUMA     3
+#define NGX_THREAD_POOL_AFFINITY_LIST     4
+
+
+typedef struct ngx_thread_fiber_s  ngx_thread_fiber_t;
+
+typedef struct {
+    ngx_thread_pool_t        *tp;
+    ngx_uint_t                index;
+    ngx_uint_t                rand;
+
+    pthread_t                 tid;
+    ngx_tid_t                 lwp;
+    /*
+     * a worker that leaves is LEAVING until it no longer touches the pool,
+     * only then it stores EXITED, and its thread may be joined
+     */
+
+    volatile ngx_uint_t       state;
+
+    ngx_thread_worker_stats_t  stats;
+
+    int                       node;
+#if (NGX_HAVE_CPU_AFFINITY)
+    ngx_uint_t                pinned;
+    ngx_cpuset_t              cpuset;
+#endif
+
+    ngx_thread_pool_deque_t   deque;
+
+    ngx_atomic_t              lock;
+    ngx_thread_pool_queue_t   inbox;
+    ngx_uint_t                ninbox;
+
+    /*
+     * a task posted to the pool by a handler running on this worker waits
+     * in lifo and runs next, the one it displaces goes to the queue
+     */
+
+    ngx_thread_task_t        *lifo;
+    ngx_uint_t                lifo_runs;
+
+    /*
+     * with "fibers=N" the worker switches from ctx to the fiber it runs,
+     * and keeps the last fiber that ran its task to the end in spare
+     */
+
+    ngx_thread_context_t      ctx;
+    ngx_thread_fiber_t       *fiber;
+    ngx_thread_fiber_t       *spare;
+
+    u_char                    pad[NGX_CPU_CACHE_LINE];
+} ngx_thread_pool_worker_t;
+
+
+/*
+ * a fiber runs tasks on a stack of its own, so that a handler waiting for
+ * a future suspends the fiber and not the worker, which goes on with other
+ * tasks.  Once the fiber is off the worker's stack it is parked on the
+ * future, whose completion queues the fiber's task like a strand's; the
+ * worker that takes the task switches to the fiber, and the handler goes
+ * on there.  If the queue is full, the task waits in the pool's woken
+ * list, see ngx_thread_pool_requeue().
+ */
+
+struct ngx_thread_fiber_s {
+    ngx_thread_context_t      ctx;
+    ngx_uint_t                state;
+    ngx_thread_pool_worker_t *worker;
+
+    ngx_thread_task_t        *run;
+    ngx_uint_t                queued;
+    ngx_thread_task_t        *next;
+    ngx_thread_future_t      *wait;
+
+    ngx_thread_task_t         task;
+
+    u_char                   *stack;
+    ngx_thread_fiber_t       *free;
+    ngx_thread_fiber_t       *all;
+};
+
+
+/*
+ * delayed tasks wait in a hierarchical timer wheel of 4 levels of 64
+ * slots: a task due in less than 64^(n+1) ms is in a slot of level n,
+ * picked by bits 6n to 6n+5 of its due time, and moves down a level when
+ * the wheel reaches the slot, so adding a timer and expiring it are O(1).
+ * The bitmaps of used slots tell the timer thread when the next slot is
+ * to be handled, it sleeps until then.  Timers beyond the span of the
+ * wheel, 2^24 ms, wait in the last slot of the top level and are put back
+ * when it is reached.
+ */
+
+#define NGX_THREAD_TIMER_BITS    6
+#define NGX_THREAD_TIMER_SLOTS   (1 << NGX_THREAD_TIMER_BITS)
+#define NGX_THREAD_TIMER_LEVELS  4
+
+#define NGX_THREAD_TIMER_SPAN                                                 \
+    ((ngx_msec_t) 1 << (NGX_THREAD_TIMER_BITS * NGX_THREAD_TIMER_LEVELS))
+
+typedef struct {
+    ngx_thread_mutex_t        mtx;
+    ngx_thread_cond_t         cond;
+
+    pthread_t                 tid;
+    ngx_uint_t                running;
+    ngx_uint_t                closed;
+
+    ngx_msec_t                now;       /* the wheel has run up to */
+    ngx_msec_t                wakeup;    /* 0 if the thread waits for timers */
+    ngx_uint_t                count;
+
+    uint64_t                  used[NGX_THREAD_TIMER_LEVELS];
+    ngx_thread_task_t        *slots[NGX_THREAD_TIMER_LEVELS]
+                                   [NGX_THREAD_TIMER_SLOTS];
+} ngx_thread_pool_wheel_t;
+
+
+/*
+ * posts are counted in shards picked by the producer's thread id, so
+ * producers on different threads rarely share a counter cache line
+ */
+
+#define NGX_THREAD_POOL_SHARDS  16
+
+typedef struct {
+    ngx_atomic_t              posted;
+    ngx_atomic_t              rejected;
+    u_char                    pad[NGX_CPU_CACHE_LINE
+                                  - 2 * sizeof(ngx_atomic_t)];
+} ngx_thread_pool_shard_t;
+
+
+/*
+ * with "trace=N" every worker slot writes a record of each task it takes
+ * into its own ring of the last N records, and publishes it by advancing
+ * pos; a reader copies the ring and then drops the records that may have
+ * been overwritten meanwhile.  The rings outlive the workers, so a pool
+ * can be traced up to its shutdown.
+ */
+
+typedef struct {
+    ngx_uint_t                id;
+    ngx_uint_t                status;
+    ngx_tid_t                 tid;
+    uint64_t                  posted;     /* 0 for a successor run in place */
+    uint64_t                  dequeued;
+    uint64_t                  start;      /* 0 for a skipped task */
+    uint64_t                  end;
+} ngx_thread_pool_event_t;
+
+typedef struct {
+    ngx_thread_pool_event_t  *events;
+    ngx_uint_t                mask;
+    ngx_atomic_t              pos;
+    u_char                    pad[NGX_CPU_CACHE_LINE];
+} ngx_thread_pool_trace_t;
+
+
+typedef struct {
+    const char               *name;
+    ngx_int_t               (*init)(ngx_thread_pool_t *tp);
+    void                    (*done)(ngx_thread_pool_t *tp);
+    ngx_int_t               (*post)(ngx_thread_pool_t *tp,
+                                    ngx_thread_task_t *task);
+    ngx_int_t               (*post_chain)(ngx_thread_pool_t *tp,
+                                          ngx_thread_task_t *task,
+                                          ngx_uint_t n);
+    ngx_thread_task_t      *(*get)(ngx_thread_pool_t *tp,
+                                   ngx_thread_pool_worker_t *worker);
+    ngx_uint_t              (*depth)(ngx_thread_pool_t *tp);
+    ngx_uint_t              (*ready)(ngx_thread_pool_t *tp);
+} ngx_thread_pool_engine_t;
+
+
 struct ngx_thread_pool_s {
     ngx_thread_mutex_t        mtx;
-    ngx_thread_pool_queue_t   queue;
+    ngx_thread_pool_queue_t   queue[NGX_THREAD_TASK_PRIORITIES];
     ngx_int_t                 waiting;
     ngx_thread_cond_t         cond;
 
+    ngx_uint_t                levels;
+    ngx_uint_t                skipped[NGX_THREAD_TASK_PRIORITIES];
+    ngx_uint_t                aging;
+
+    ngx_thread_pool_engine_t *engine;
+    ngx_atomic_t              idle;
+
+    /*
+     * with "park=futex" idle workers spin for a while, then sleep on
+     * the futex word, and producers only make the wake syscall when
+     * somebody is counted in parked
+     */
+
+    ngx_uint_t                futex_park;
+    ngx_uint_t                spin;
+    volatile uint32_t         futex;
+    ngx_atomic_t              parked;
+
+    /* producers blocked on a full queue sleep on space */
+
+    volatile uint32_t         space;
+    ngx_atomic_t              blocked;
+
+    ngx_thread_pool_ring_t    ring;
+
+    ngx_thread_pool_worker_t *workers;
+    ngx_uint_t                share;
+
+    ngx_thread_task_t *volatile  done;
+    int                       notify;
+
+    /* a completion source that signals notify itself, e.g. an io_uring */
+
+    ngx_thread_pool_poll_pt   poll;
+    void                     *poll_data;
+
+    ngx_thread_task_slab_t    slabs[NGX_THREAD_TASK_SLABS];
+
+    /* tasks are stamped at posting for "latency=on" and "trace=N" */
+
+    ngx_uint_t                latency;
+
+    ngx_uint_t                trace;
+    ngx_uint_t                ntraces;
+    ngx_thread_pool_trace_t  *traces;
+
+    /* up to "fibers=N" fibers with stacks of "fiber_stack=size" */
+
+    ngx_uint_t                fibers;
+    size_t                    fiber_stack;
+    ngx_atomic_t              fiber_lock;
+    ngx_uint_t                nfibers;
+    ngx_thread_fiber_t       *fiber_free;
+    ngx_thread_fiber_t       *fiber_all;
+    ngx_atomic_t              suspended;
+    volatile uint32_t         waking;
+
+    /* fibers and strands waiting for room in the queue */
+
+    ngx_thread_task_t *volatile  woken;
+
+    ngx_thread_pool_wheel_t   wheel;
+
+    u_char                    pad0[NGX_CPU_CACHE_LINE];
+    ngx_thread_pool_shard_t   shards[NGX_THREAD_POOL_SHARDS];
+
     //ngx_log_t                *log;
 
-    //ngx_str_t                 name;
+    char                     *name;
     ngx_uint_t                threads;
     ngx_int_t                 max_queue;
+
+    /*
+     * elastic pools run between min_threads and threads workers: the
+     * manager thread adds a worker when the queue stays deeper than
+     * grow_threshold for grow_interval and the last added worker did
+     * improve throughput, workers idle for idle_timeout exit
+     */
+
+    ngx_uint_t                min_threads;
+    ngx_uint_t                nthreads;
+    ngx_msec_t                idle_timeout;
+    ngx_uint_t                grow_threshold;
+    ngx_msec_t                grow_interval;
+
+    pthread_t                 manager;
+    ngx_thread_cond_t         manager_cond;
+    ngx_uint_t                manager_exit;
+
+    /*
+     * ngx_thread_pool_shutdown() waits on exit_cond for the last worker,
+     * on abort workers move the tasks they take to dropped unrun
+     */
+
+    volatile ngx_uint_t       exiting;
+    ngx_thread_cond_t         exit_cond;
+    ngx_thread_pool_queue_t   dropped;
+
+    /*
+     * workers are pinned to cpus on start, with "route=node" the "steal"
+     * queue prefers the inboxes and victims on the poster's NUMA node
+     */
+
+    ngx_uint_t                affinity;
+    ngx_uint_t                route;
+#if (NGX_HAVE_CPU_AFFINITY)
+    ngx_cpuset_t              cpus;
+#endif
+
+    ngx_uint_t                started;
 };
 
 
+#define ngx_thread_pool_timed(tp)  ((tp)->latency || (tp)->trace)
+
+
 static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp);
-static void ngx_thread_pool_destroy(ngx_thread_pool_t *tp);
-static void ngx_thread_pool_exit_handler(void *data);
+static ngx_int_t ngx_thread_pool_init_pool(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_exit(ngx_thread_pool_t *tp, ngx_uint_t mode);
+static ngx_int_t ngx_thread_pool_spawn(ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_pool_park(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_flush(void);
+#if (NGX_HAVE_FUTEX)
+static ngx_int_t ngx_thread_pool_park_futex(ngx_thread_pool_t *tp);
+#endif
+static ngx_uint_t ngx_thread_pool_retire(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker);
+static void *ngx_thread_pool_manager(void *data);
+static ngx_uint_t ngx_thread_pool_completed(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_count(ngx_thread_pool_t *tp, ngx_int_t rc,
+    ngx_uint_t n);
+static ngx_uint_t ngx_thread_pool_bucket(uint64_t usec);
+static ngx_int_t ngx_thread_pool_trace_init(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_trace(ngx_thread_pool_trace_t *trace,
+    ngx_thread_pool_event_t *ev);
+static ngx_int_t ngx_thread_pool_trace_write(ngx_thread_pool_t *tp,
+    ngx_uint_t pid, FILE *f, ngx_uint_t *first);
+#if (NGX_HAVE_CPU_AFFINITY)
+static ngx_int_t ngx_thread_pool_affinity(ngx_thread_pool_t *tp);
+static int ngx_thread_pool_cmp_scatter(const void *one, const void *two);
+#endif
+
+static ngx_int_t ngx_thread_pool_list_init(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_list_done(ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_pool_list_post(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_int_t ngx_thread_pool_list_post_chain(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_uint_t n);
+static ngx_thread_task_t *ngx_thread_pool_list_get(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker);
+static ngx_uint_t ngx_thread_pool_list_depth(ngx_thread_pool_t *tp);
+static ngx_uint_t ngx_thread_pool_list_ready(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_list_add(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_thread_task_t *ngx_thread_pool_list_take(ngx_thread_pool_t *tp);
+
+static ngx_int_t ngx_thread_pool_ring_init(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_ring_done(ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_pool_ring_post(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_int_t ngx_thread_pool_ring_post_chain(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_uint_t n);
+static ngx_thread_task_t *ngx_thread_pool_ring_get(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker);
+static ngx_uint_t ngx_thread_pool_ring_depth(ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_pool_ring_push(ngx_thread_pool_ring_t *ring,
+    ngx_thread_task_t *task);
+static ngx_thread_task_t *ngx_thread_pool_ring_pop(
+    ngx_thread_pool_ring_t *ring);
+
+static ngx_int_t ngx_thread_pool_steal_init(ngx_thread_pool_t *tp);
+static void ngx_thread_pool_steal_done(ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_pool_steal_post(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_int_t ngx_thread_pool_steal_post_chain(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_uint_t n);
+static ngx_thread_task_t *ngx_thread_pool_steal_get(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker);
+static ngx_uint_t ngx_thread_pool_steal_depth(ngx_thread_pool_t *tp);
+static ngx_thread_pool_worker_t *ngx_thread_pool_steal_inbox(
+    ngx_thread_pool_t *tp, ngx_uint_t i, int node);
+static ngx_thread_task_t *ngx_thread_pool_steal(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker);
+static ngx_uint_t ngx_thread_pool_steal_ready(ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_pool_deque_push(ngx_thread_pool_deque_t *deque,
+    ngx_thread_task_t *task);
+static ngx_thread_task_t *ngx_thread_pool_deque_take(
+    ngx_thread_pool_deque_t *deque);
+static ngx_thread_task_t *ngx_thread_pool_deque_steal(
+    ngx_thread_pool_deque_t *deque);
+
+static ngx_int_t ngx_thread_pool_post(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static void ngx_thread_pool_wake(ngx_thread_pool_t *tp, ngx_uint_t n);
+static void ngx_thread_pool_requeue(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_thread_task_t *ngx_thread_pool_woken(ngx_thread_pool_t *tp);
+#if (NGX_HAVE_FUTEX)
+static void ngx_thread_pool_space(ngx_thread_pool_t *tp);
+static void ngx_thread_future_complete(ngx_thread_future_t *future,
+    ngx_uint_t status);
+#endif
+static void ngx_thread_pool_chain_ids(ngx_thread_task_t *task, ngx_uint_t n);
 
 static void *ngx_thread_pool_cycle(void *data);
-static void ngx_thread_pool_handler();
+static ngx_thread_task_t *ngx_thread_pool_run(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker, ngx_thread_task_t *task,
+    ngx_uint_t queued);
+static void ngx_thread_pool_strand(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker, ngx_thread_strand_t *strand);
+static ngx_thread_task_t *ngx_thread_pool_finish(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_thread_task_t *ngx_thread_pool_drop(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_thread_pool_worker_t *ngx_thread_pool_handler(
+    ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker,
+    ngx_thread_task_t *task);
+static ngx_thread_pool_worker_t *ngx_thread_pool_self(void)
+    __attribute__ ((noinline));
+
+static ngx_thread_task_t *ngx_thread_fiber_run(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker, ngx_thread_task_t *task,
+    ngx_uint_t queued);
+static ngx_thread_task_t *ngx_thread_fiber_resume(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker, ngx_thread_fiber_t *fiber);
+static void ngx_thread_fiber_start(void);
+static void ngx_thread_fiber_suspend(ngx_thread_fiber_t *fiber,
+    ngx_thread_future_t *future);
+static void ngx_thread_fiber_park(ngx_thread_pool_t *tp,
+    ngx_thread_fiber_t *fiber);
+static void ngx_thread_fiber_wake(ngx_thread_pool_t *tp,
+    ngx_thread_fiber_t *fiber);
+static void ngx_thread_fiber_linger(ngx_thread_pool_t *tp);
+static ngx_thread_fiber_t *ngx_thread_fiber_get(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker);
+static void ngx_thread_fiber_put(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker, ngx_thread_fiber_t *fiber);
+static void ngx_thread_fiber_free(ngx_thread_pool_t *tp);
+
+static ngx_int_t ngx_thread_pool_post_timer(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_msec_t delay);
+static ngx_uint_t ngx_thread_pool_rearm(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_int_t ngx_thread_pool_timer_add(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static ngx_int_t ngx_thread_pool_timer_arm(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+static void *ngx_thread_pool_timer(void *data);
+static ngx_thread_task_t *ngx_thread_pool_timer_close(ngx_thread_pool_t *tp);
+static void ngx_thread_wheel_add(ngx_thread_pool_wheel_t *wheel,
+    ngx_thread_task_t *task);
+static ngx_msec_t ngx_thread_wheel_next(ngx_thread_pool_wheel_t *wheel);
+static ngx_thread_task_t *ngx_thread_wheel_run(ngx_thread_pool_wheel_t *wheel,
+    ngx_msec_t now);
+static void ngx_thread_pool_done(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+
+static ngx_thread_task_cache_t *ngx_thread_task_cache(
+    ngx_thread_task_slab_t *slab);
+static ngx_int_t ngx_thread_task_refill(ngx_thread_task_cache_t *cache);
+static void ngx_thread_task_flush(ngx_thread_task_cache_t *cache,
+    ngx_uint_t n);
+static void ngx_thread_task_cache_exit(void *data);
+static void ngx_thread_task_cache_key(void);
+
+static ngx_int_t ngx_thread_pool_directive(char *line);
+static ngx_int_t ngx_thread_pool_atoi(const char *line, size_t n);
+static ngx_int_t ngx_thread_pool_size(const char *line, size_t n);
 
-static ngx_uint_t               ngx_thread_pool_task_id;
-static ngx_atomic_t             ngx_thread_pool_done_lock;
-//static ngx_thread_pool_queue_t  ngx_thread_pool_done;
 
-static ngx_thread_pool_t g_tp; //me
+static ngx_thread_pool_engine_t  ngx_thread_pool_engines[] = {
+
+    { "list",
+      ngx_thread_pool_list_init,
+      ngx_thread_pool_list_done,
+      ngx_thread_pool_list_post,
+      ngx_thread_pool_list_post_chain,
+      ngx_thread_pool_list_get,
+      ngx_thread_pool_list_depth,
+      ngx_thread_pool_list_ready },
+
+    { "ring",
+      ngx_thread_pool_ring_init,
+      ngx_thread_pool_ring_done,
+      ngx_thread_pool_ring_post,
+      ngx_thread_pool_ring_post_chain,
+      ngx_thread_pool_ring_get,
+      ngx_thread_pool_ring_depth,
+      ngx_thread_pool_ring_depth },
+
+    { "steal",
+      ngx_thread_pool_steal_init,
+      ngx_thread_pool_steal_done,
+      ngx_thread_pool_steal_post,
+      ngx_thread_pool_steal_post_chain,
+      ngx_thread_pool_steal_get,
+      ngx_thread_pool_steal_depth,
+      ngx_thread_pool_steal_ready },
+
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+
+static ngx_atomic_t             ngx_thread_pool_task_id;
+
+typedef struct {
+    ngx_thread_pool_t       **elts;
+    ngx_uint_t                nelts;
+    ngx_uint_t                nalloc;
+} ngx_thread_pool_conf_t;
+
+static ngx_thread_pool_conf_t   ngx_thread_pool_conf;
+
+static __thread ngx_uint_t      ngx_thread_pool_rr;
+static __thread ngx_thread_pool_worker_t  *ngx_thread_pool_current;
+static __thread ngx_uint_t      ngx_thread_pool_shard;
+
+static ngx_uint_t               ngx_thread_task_slab_index;
+static ngx_thread_task_slab_t   ngx_thread_task_heap;   /* large ctx */
+static pthread_key_t            ngx_thread_task_key;
+static pthread_once_t           ngx_thread_task_once = PTHREAD_ONCE_INIT;
+static __thread ngx_uint_t      ngx_thread_task_cached;
+static __thread ngx_thread_task_cache_t
+                    ngx_thread_task_caches[NGX_THREAD_TASK_CACHES];
 
 ngx_int_t   ngx_ncpu = 1;
 
 static ngx_int_t
 ngx_thread_pool_init(ngx_thread_pool_t *tp)
 {
-    int             err;
-    pthread_t       tid;
-    ngx_uint_t      n;
-    pthread_attr_t  attr;
+    int                        err;
+    ngx_uint_t                 n;
+    ngx_thread_pool_worker_t  *worker;
 
-    //if (ngx_notify == NULL) {
-    //    ngx_log_error(NGX_LOG_ALERT, log, 0,
-    //           "the configured event method cannot be used with thread pools");
-    //    return NGX_ERROR;
-    //}
+    if (tp->engine == NULL) {
+        tp->engine = &ngx_thread_pool_engines[0];
+    }
+
+    tp->workers = calloc(tp->threads, sizeof(ngx_thread_pool_worker_t));
+    if (tp->workers == NULL) {
+        LOG_ERROR("calloc() failed");
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < tp->threads; n++) {
+        worker = &tp->workers[n];
+
+        worker->tp = tp;
+        worker->index = n;
+        worker->rand = n * 2654435761u + 1;
+    }
+
+    if (tp->trace && ngx_thread_pool_trace_init(tp) != NGX_OK) {
+        free(tp->workers);
+        return NGX_ERROR;
+    }
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+    if (ngx_thread_pool_affinity(tp) != NGX_OK) {
+        free(tp->workers);
+        return NGX_ERROR;
+    }
+
+#endif
+
+    if (ngx_thread_mutex_create(&tp->mtx) != NGX_OK) {
+        free(tp->workers);
+        return NGX_ERROR;
+    }
+
+    if (ngx_thread_cond_create(&tp->cond) != NGX_OK) {
+        (void) ngx_thread_mutex_destroy(&tp->mtx);
+        free(tp->workers);
+        return NGX_ERROR;
+    }
+
+    if (ngx_thread_cond_create(&tp->exit_cond) != NGX_OK) {
+        (void) ngx_thread_cond_destroy(&tp->cond);
+        (void) ngx_thread_mutex_destroy(&tp->mtx);
+        free(tp->workers);
+        return NGX_ERROR;
+    }
+
+    if (tp->engine->init(tp) != NGX_OK) {
+        (void) ngx_thread_cond_destroy(&tp->exit_cond);
+        (void) ngx_thread_cond_destroy(&tp->cond);
+        (void) ngx_thread_mutex_destroy(&tp->mtx);
+        free(tp->workers);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(tp->shards, sizeof(tp->shards));
+
+    tp->done = NULL;
+    tp->notify = -1;
+
+#if (NGX_HAVE_EVENTFD)
+
+    tp->notify = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+    if (tp->notify == -1) {
+        LOG_ERROR("eventfd() failed, errno %d", errno);
+        tp->engine->done(tp);
+        (void) ngx_thread_cond_destroy(&tp->exit_cond);
+        (void) ngx_thread_cond_destroy(&tp->cond);
+        (void) ngx_thread_mutex_destroy(&tp->mtx);
+        free(tp->workers);
+        return NGX_ERROR;
+    }
+
+#endif
+
+    tp->wheel.closed = 0;
+    tp->wheel.now = ngx_monotonic_msec();
+
+    tp->started = 1;
+
+    ngx_thread_wait_handler = ngx_thread_pool_flush;
+
+    //tp->log = log;
+
+    if (tp->min_threads == 0 || tp->min_threads > tp->threads) {
+        tp->min_threads = tp->threads;
+    }
 
-    ngx_thread_pool_queue_init(&tp->queue);
+    tp->nthreads = 0;
+
+    for (n = 0; n < tp->min_threads; n++) {
+        if (ngx_thread_pool_spawn(tp) != NGX_OK) {
+            goto failed;
+        }
+    }
+
+    if (tp->min_threads == tp->threads) {
+        return NGX_OK;
+    }
+
+    if (ngx_thread_cond_create(&tp->manager_cond) != NGX_OK) {
+        goto failed;
+    }
+
+    tp->manager_exit = 0;
+
+    err = pthread_create(&tp->manager, NULL, ngx_thread_pool_manager, tp);
+    if (err) {
+        LOG_ERROR("pthread_create() failed");
+        (void) ngx_thread_cond_destroy(&tp->manager_cond);
+        goto failed;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    /* no manager runs, so the shutdown only stops the spawned workers */
+
+    n = tp->min_threads;
+    tp->min_threads = tp->threads;
+
+    (void) ngx_thread_pool_shutdown(tp, NGX_THREAD_POOL_ABORT, 0, NULL);
+
+    tp->min_threads = n;
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_spawn(ngx_thread_pool_t *tp)
+{
+    int                        err;
+    ngx_uint_t                 n;
+    pthread_attr_t             attr;
+    ngx_thread_pool_worker_t  *worker;
+
+    for (n = 0; n < tp->threads; n++) {
+        if (tp->workers[n].state == NGX_THREAD_POOL_WORKER_FREE
+            || tp->workers[n].state == NGX_THREAD_POOL_WORKER_EXITED)
+        {
+            break;
+        }
+    }
+
+    if (n == tp->threads) {
+        return NGX_DECLINED;
+    }
+
+    worker = &tp->workers[n];
+
+    if (worker->state == NGX_THREAD_POOL_WORKER_EXITED) {
+        (void) pthread_join(worker->tid, NULL);
+        worker->state = NGX_THREAD_POOL_WORKER_FREE;
+    }
+
+    err = pthread_attr_init(&attr);
+    if (err) {
+        //ngx_log_error(NGX_LOG_ALERT, log, err,
+        //              "pthread_attr_init() failed");
+        LOG_ERROR("pthread_attr_init() failed");
+        return NGX_ERROR;
+    }
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+    if (worker->pinned) {
+        err = pthread_attr_setaffinity_np(&attr, sizeof(ngx_cpuset_t),
+                                          &worker->cpuset);
+        if (err) {
+            /* not fatal, the worker runs unpinned */
+            LOG_ERROR("pthread_attr_setaffinity_np() failed, errno %d", err);
+        }
+    }
+
+#endif
+
+#if 0
+    err = pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
+    if (err) {
+        //ngx_log_error(NGX_LOG_ALERT, log, err,
+        //              "pthread_attr_setstacksize() failed");
+        LOG_ERROR("pthread_attr_setstacksize() failed");
+        return NGX_ERROR;
+    }
+#endif
+
+    err = pthread_create(&worker->tid, &attr, ngx_thread_pool_cycle, worker);
+
+    (void) pthread_attr_destroy(&attr);
+
+    if (err) {
+        //ngx_log_error(NGX_LOG_ALERT, log, err,
+        //              "pthread_create() failed");
+        LOG_ERROR("pthread_create() failed");
+        return NGX_ERROR;
+    }
+
+    worker->state = NGX_THREAD_POOL_WORKER_RUNNING;
+    tp->nthreads++;
+
+    return NGX_OK;
+}
+
+
+/* called with tp->mtx locked, returns NGX_AGAIN after idle_timeout */
+
+static ngx_int_t
+ngx_thread_pool_park(ngx_thread_pool_t *tp)
+{
+#if (NGX_HAVE_FUTEX)
+    if (tp->futex_park) {
+        return ngx_thread_pool_park_futex(tp);
+    }
+#endif
+
+    if (tp->min_threads == tp->threads) {
+        return ngx_thread_cond_wait(&tp->cond, &tp->mtx);
+    }
+
+    return ngx_thread_cond_timedwait(&tp->cond, &tp->mtx, tp->idle_timeout);
+}
+
+
+#if (NGX_HAVE_FUTEX)
+
+static ngx_int_t
+ngx_thread_pool_park_futex(ngx_thread_pool_t *tp)
+{
+    uint32_t    seq;
+    ngx_int_t   rc;
+    ngx_uint_t  i;
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    rc = NGX_OK;
+
+    if (ngx_ncpu > 1) {
+        for (i = 0; i < tp->spin; i++) {
+            if (tp->engine->ready(tp) || tp->exiting) {
+                goto done;
+            }
+
+            ngx_cpu_pause();
+        }
+    }
+
+    /*
+     * a post after reading seq changes the futex word, and the barrier
+     * of the increment pairs with the one in ngx_thread_pool_wake():
+     * either the producer sees us parked, or we see its task
+     */
+
+    seq = ngx_atomic_load(&tp->futex);
+
+    (void) ngx_atomic_fetch_add(&tp->parked, 1);
+
+    if (!tp->engine->ready(tp) && !tp->exiting) {
+        rc = ngx_futex_wait(&tp->futex, seq,
+                            (tp->min_threads == tp->threads)
+                            ? 0 : tp->idle_timeout);
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->parked, -1);
+
+done:
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+#endif
+
+
+/* called with tp->mtx locked when the worker timed out with no tasks */
+
+static ngx_uint_t
+ngx_thread_pool_retire(ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker)
+{
+    if (tp->nthreads <= tp->min_threads) {
+        return 0;
+    }
+
+    tp->nthreads--;
+    worker->state = NGX_THREAD_POOL_WORKER_LEAVING;
+
+    return 1;
+}
+
+
+static void *
+ngx_thread_pool_manager(void *data)
+{
+    ngx_thread_pool_t *tp = data;
+
+    ngx_int_t   rc;
+    ngx_uint_t  above, probe, hold, backoff, ceiling, completed, last, rate,
+                base;
+    ngx_msec_t  now, prev;
+
+    above = 0;
+    probe = 0;
+    hold = 0;
+    backoff = 16;
+    base = 0;
+    ceiling = tp->threads;
+
+    last = ngx_thread_pool_completed(tp);
+    prev = ngx_monotonic_msec();
+
+    for ( ;; ) {
+        if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+            return NULL;
+        }
+
+        rc = NGX_OK;
+
+        if (!tp->manager_exit) {
+            rc = ngx_thread_cond_timedwait(&tp->manager_cond, &tp->mtx,
+                                           tp->grow_interval);
+        }
+
+        if (tp->manager_exit || rc == NGX_ERROR) {
+            (void) ngx_thread_mutex_unlock(&tp->mtx);
+            return NULL;
+        }
+
+        now = ngx_monotonic_msec();
+        completed = ngx_thread_pool_completed(tp);
+
+        rate = (completed - last) * 1000 / (now - prev + 1);
+
+        last = completed;
+        prev = now;
+
+        /*
+         * hill climbing: if the worker added in the previous round did
+         * not raise completions per second by at least 5%, more workers
+         * do not help with this load, hold at the current count for a
+         * while before probing again, longer after each failed probe
+         */
+
+        if (probe) {
+            probe = 0;
+
+            if (rate * 100 < base * 105) {
+                ceiling = tp->nthreads;
+                hold = backoff;
+
+                if (backoff < 1024) {
+                    backoff *= 2;
+                }
+
+            } else {
+                backoff = 16;
+            }
+        }
+
+        if (hold && --hold == 0) {
+            ceiling = tp->threads;
+        }
+
+        if (tp->engine->depth(tp) > tp->grow_threshold) {
+            above++;
+
+        } else {
+            above = 0;
+        }
+
+        if (above > 1 && tp->nthreads < ceiling) {
+            if (ngx_thread_pool_spawn(tp) == NGX_OK) {
+                LOG_INFO("thread pool \"%s\" grows to %lu threads, "
+                         "%lu tasks/s", tp->name, tp->nthreads, rate);
+                base = rate;
+                probe = 1;
+            }
+
+            above = 0;
+        }
+
+        (void) ngx_thread_mutex_unlock(&tp->mtx);
+    }
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_completed(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t  i, n;
+
+    n = 0;
+
+    for (i = 0; i < tp->threads; i++) {
+        n += tp->workers[i].stats.completed;
+    }
+
+    return n;
+}
+
+
+static void
+ngx_thread_pool_count(ngx_thread_pool_t *tp, ngx_int_t rc, ngx_uint_t n)
+{
+    ngx_thread_pool_shard_t  *shard;
+
+    if (ngx_thread_pool_shard == 0) {
+        ngx_thread_pool_shard = ngx_thread_tid() % NGX_THREAD_POOL_SHARDS + 1;
+    }
+
+    shard = &tp->shards[ngx_thread_pool_shard - 1];
+
+    if (rc == NGX_OK) {
+        (void) ngx_atomic_fetch_add(&shard->posted, n);
+
+    } else {
+        (void) ngx_atomic_fetch_add(&shard->rejected, n);
+    }
+}
+
+
+/* bucket i > 0 holds 2^(i-1) .. 2^i - 1 microseconds */
+
+static ngx_uint_t
+ngx_thread_pool_bucket(uint64_t usec)
+{
+    ngx_uint_t  i;
+
+    if (usec == 0) {
+        return 0;
+    }
+
+    i = 64 - __builtin_clzll(usec);
+
+    return (i < NGX_THREAD_POOL_BUCKETS) ? i : NGX_THREAD_POOL_BUCKETS - 1;
+}
+
+
+ngx_uint_t
+ngx_thread_pool_stats(ngx_thread_pool_t *tp, ngx_thread_pool_stats_t *stats,
+    ngx_thread_worker_stats_t *workers, ngx_uint_t n)
+{
+    ngx_uint_t                  i, j;
+    ngx_thread_worker_stats_t  *ws, *total;
+
+    ngx_memzero(stats, sizeof(ngx_thread_pool_stats_t));
+
+    for (i = 0; i < NGX_THREAD_POOL_SHARDS; i++) {
+        stats->posted += tp->shards[i].posted;
+        stats->rejected += tp->shards[i].rejected;
+    }
+
+    if (!tp->started) {
+        return 0;
+    }
+
+    stats->depth = tp->engine->depth(tp);
+    stats->threads = tp->nthreads;
+    stats->idle = tp->idle;
+
+    total = &stats->total;
+
+    for (i = 0; i < tp->threads; i++) {
+        ws = &tp->workers[i].stats;
+
+        if (i < n) {
+            workers[i] = *ws;
+        }
+
+        total->completed += ws->completed;
+        total->skipped += ws->skipped;
+        total->busy += ws->busy;
+
+        for (j = 0; j < NGX_THREAD_POOL_BUCKETS; j++) {
+            total->wait[j] += ws->wait[j];
+            total->run[j] += ws->run[j];
+        }
+    }
+
+    return (n < tp->threads) ? n : tp->threads;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_trace_init(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t                i, n;
+    ngx_thread_pool_trace_t  *traces;
+
+    for (n = 2; n < tp->trace; n <<= 1) { /* void */ }
+
+    traces = calloc(tp->threads, sizeof(ngx_thread_pool_trace_t));
+    if (traces == NULL) {
+        LOG_ERROR("calloc() failed");
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < tp->threads; i++) {
+        traces[i].events = malloc(n * sizeof(ngx_thread_pool_event_t));
+        if (traces[i].events == NULL) {
+            LOG_ERROR("malloc(%lu) failed", n * sizeof(ngx_thread_pool_event_t));
+
+            while (i--) {
+                free(traces[i].events);
+            }
+
+            free(traces);
+            return NGX_ERROR;
+        }
+
+        traces[i].mask = n - 1;
+    }
+
+    /* the records of the previous run are dropped on restart */
+
+    for (i = 0; i < tp->ntraces; i++) {
+        free(tp->traces[i].events);
+    }
+
+    free(tp->traces);
+
+    tp->traces = traces;
+    tp->ntraces = tp->threads;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_pool_trace(ngx_thread_pool_trace_t *trace,
+    ngx_thread_pool_event_t *ev)
+{
+    ngx_atomic_uint_t  pos;
+
+    pos = trace->pos;
+
+    trace->events[pos & trace->mask] = *ev;
+
+    ngx_atomic_store(&trace->pos, pos + 1);
+}
+
+
+ngx_int_t
+ngx_thread_pool_trace_dump(ngx_thread_pool_t *tp, const char *path)
+{
+    FILE                     *f;
+    ngx_int_t                 rc;
+    ngx_uint_t                i, first;
+    ngx_thread_pool_conf_t   *tcf;
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        LOG_ERROR("fopen(\"%s\") failed, errno %d", path, errno);
+        return NGX_ERROR;
+    }
+
+    fprintf(f, "{\"traceEvents\":[");
+
+    rc = NGX_OK;
+    first = 1;
+
+    tcf = &ngx_thread_pool_conf;
+
+    for (i = 0; i < tcf->nelts && rc == NGX_OK; i++) {
+        if (tp == NULL || tp == tcf->elts[i]) {
+            rc = ngx_thread_pool_trace_write(tcf->elts[i], i + 1, f, &first);
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        LOG_ERROR("fclose(\"%s\") failed, errno %d", path, errno);
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_trace_write(ngx_thread_pool_t *tp, ngx_uint_t pid, FILE *f,
+    ngx_uint_t *first)
+{
+    ngx_tid_t                 tid;
+    ngx_uint_t                i, n, size;
+    ngx_atomic_uint_t         pos, base, from, last;
+    ngx_thread_pool_event_t  *ev, *events;
+    ngx_thread_pool_trace_t  *trace;
+
+    static const char  *status[] = { "done", "cancelled", "expired" };
+
+    if (tp->ntraces == 0) {
+        return NGX_OK;
+    }
+
+    size = tp->traces[0].mask + 1;
+
+    events = malloc(size * sizeof(ngx_thread_pool_event_t));
+    if (events == NULL) {
+        LOG_ERROR("malloc(%lu) failed", size * sizeof(ngx_thread_pool_event_t));
+        return NGX_ERROR;
+    }
+
+    fprintf(f, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,"
+            "\"args\":{\"name\":\"thread pool %s\"}}",
+            *first ? "" : ",", pid, tp->name);
+
+    *first = 0;
+
+    for (n = 0; n < tp->ntraces; n++) {
+        trace = &tp->traces[n];
+
+        last = ngx_atomic_load(&trace->pos);
+        base = (last > size) ? last - size : 0;
+
+        for (pos = base; pos < last; pos++) {
+            events[pos - base] = trace->events[pos & trace->mask];
+        }
+
+        /* a record being written now overwrites the one at pos - size */
+
+        ngx_memory_barrier();
+
+        pos = ngx_atomic_load(&trace->pos);
+
+        from = (pos + 1 > base + size) ? pos + 1 - size : base;
+
+        tid = 0;
+
+        for (pos = from; pos < last; pos++) {
+            ev = &events[pos - base];
+
+            if (ev->tid != tid) {
+                tid = ev->tid;
+
+                fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                        "\"pid\":%lu,\"tid\":%d,"
+                        "\"args\":{\"name\":\"%s worker %lu\"}}",
+                        pid, (int) tid, tp->name, n);
+            }
+
+            if (ev->posted) {
+                fprintf(f, ",\n{\"name\":\"queued\",\"cat\":\"queue\","
+                        "\"ph\":\"b\",\"id\":%lu,\"pid\":%lu,\"tid\":%d,"
+                        "\"ts\":%lu}"
+                        ",\n{\"name\":\"queued\",\"cat\":\"queue\","
+                        "\"ph\":\"e\",\"id\":%lu,\"pid\":%lu,\"tid\":%d,"
+                        "\"ts\":%lu}",
+                        ev->id, pid, (int) ev->tid, (ngx_uint_t) ev->posted,
+                        ev->id, pid, (int) ev->tid, (ngx_uint_t) ev->dequeued);
+            }
+
+            i = (ev->status < 3) ? ev->status : 0;
+
+            fprintf(f, ",\n{\"name\":\"task %s\",\"cat\":\"task\","
+                    "\"ph\":\"X\",\"pid\":%lu,\"tid\":%d,"
+                    "\"ts\":%lu,\"dur\":%lu,"
+                    "\"args\":{\"id\":%lu,\"wait\":%lu}}",
+                    status[i], pid, (int) ev->tid,
+                    (ngx_uint_t) (ev->start ? ev->start : ev->dequeued),
+                    (ngx_uint_t) (ev->end - (ev->start ? ev->start
+                                                       : ev->dequeued)),
+                    ev->id,
+                    (ngx_uint_t) (ev->posted ? ev->dequeued - ev->posted : 0));
+        }
+    }
+
+    free(events);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+/*
+ * "compact" fills the hyperthreads of a core, then the cores of a package,
+ * "scatter" gives every worker its own core first and spreads them over
+ * packages, "numa" binds workers round robin to all cpus of a node, and
+ * a cpu list binds workers round robin to the listed cpus
+ */
+
+static ngx_int_t
+ngx_thread_pool_affinity(ngx_thread_pool_t *tp)
+{
+    int                        nodes[CPU_SETSIZE];
+    ngx_uint_t                 i, j, n, nnodes;
+    ngx_cpu_t                 *cpus, *order;
+    ngx_thread_pool_worker_t  *worker;
+
+    if (tp->route && tp->affinity == NGX_THREAD_POOL_AFFINITY_NONE) {
+        tp->affinity = NGX_THREAD_POOL_AFFINITY_NUMA;
+    }
+
+    if (tp->affinity == NGX_THREAD_POOL_AFFINITY_NONE) {
+        return NGX_OK;
+    }
+
+    cpus = ngx_cpu_topology(&n);
+
+    order = malloc(n * sizeof(ngx_cpu_t));
+    if (order == NULL) {
+        LOG_ERROR("malloc() failed");
+        return NGX_ERROR;
+    }
+
+    if (tp->affinity == NGX_THREAD_POOL_AFFINITY_LIST) {
+
+        for (i = 0, j = 0; i < n; i++) {
+            if (CPU_ISSET(cpus[i].cpu, &tp->cpus)) {
+                order[j++] = cpus[i];
+            }
+        }
+
+        if (j == 0) {
+            LOG_ERROR("thread pool \"%s\" affinity cpus are not available",
+                      tp->name);
+            free(order);
+            return NGX_ERROR;
+        }
+
+        n = j;
+
+    } else {
+        memcpy(order, cpus, n * sizeof(ngx_cpu_t));
+
+        if (tp->affinity == NGX_THREAD_POOL_AFFINITY_SCATTER) {
+            qsort(order, n, sizeof(ngx_cpu_t), ngx_thread_pool_cmp_scatter);
+        }
+    }
+
+    /* nodes with cpus available to us, in order of first appearance */
+
+    nnodes = 0;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < nnodes; j++) {
+            if (nodes[j] == order[i].node) {
+                break;
+            }
+        }
+
+        if (j == nnodes) {
+            nodes[nnodes++] = order[i].node;
+        }
+    }
+
+    for (i = 0; i < tp->threads; i++) {
+        worker = &tp->workers[i];
+
+        CPU_ZERO(&worker->cpuset);
+
+        if (tp->affinity == NGX_THREAD_POOL_AFFINITY_NUMA) {
+            worker->node = nodes[i % nnodes];
+
+            for (j = 0; j < n; j++) {
+                if (order[j].node == worker->node) {
+                    CPU_SET(order[j].cpu, &worker->cpuset);
+                }
+            }
+
+            LOG_DEBUG("thread pool \"%s\" worker %lu bound to node %d",
+                      tp->name, i, worker->node);
+
+        } else {
+            worker->node = order[i % n].node;
+
+            CPU_SET(order[i % n].cpu, &worker->cpuset);
+
+            LOG_DEBUG("thread pool \"%s\" worker %lu bound to cpu %d",
+                      tp->name, i, order[i % n].cpu);
+        }
+
+        worker->pinned = 1;
+    }
+
+    free(order);
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_thread_pool_cmp_scatter(const void *one, const void *two)
+{
+    const ngx_cpu_t  *a = one;
+    const ngx_cpu_t  *b = two;
+
+    if (a->smt != b->smt) {
+        return a->smt - b->smt;
+    }
+
+    if (a->core_rank != b->core_rank) {
+        return a->core_rank - b->core_rank;
+    }
+
+    if (a->package != b->package) {
+        return a->package - b->package;
+    }
+
+    return a->cpu - b->cpu;
+}
+
+#endif
+
+
+ngx_int_t
+ngx_thread_pool_shutdown(ngx_thread_pool_t *tp, ngx_uint_t mode,
+    ngx_msec_t timeout, ngx_thread_task_t **left)
+{
+    ngx_int_t                  rc;
+    ngx_uint_t                 n, min_threads;
+    ngx_msec_t                 deadline, now;
+    ngx_thread_task_t         *timers, *task, *next;
+    ngx_thread_pool_worker_t  *worker;
+
+    if (left) {
+        *left = NULL;
+    }
+
+    if (!tp->started) {
+        return NGX_OK;
+    }
+
+    min_threads = tp->min_threads;
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* stop growing and retiring, so the number of workers is stable */
+
+    tp->manager_exit = 1;
+    tp->min_threads = tp->threads;
+
+    if (min_threads != tp->threads) {
+        (void) ngx_thread_cond_signal(&tp->manager_cond);
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    if (min_threads != tp->threads) {
+        (void) pthread_join(tp->manager, NULL);
+        (void) ngx_thread_cond_destroy(&tp->manager_cond);
+    }
+
+    /* delayed tasks that are not due yet are dropped */
+
+    timers = ngx_thread_pool_timer_close(tp);
+
+    deadline = timeout ? ngx_monotonic_msec() + timeout : 0;
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_thread_pool_queue_init(&tp->dropped);
+
+    ngx_thread_pool_exit(tp, mode);
+
+    /* workers leave once the queue is empty, or right away on abort */
+
+    while (tp->nthreads) {
+
+        if (deadline && tp->exiting == NGX_THREAD_POOL_DRAIN) {
+            now = ngx_monotonic_msec();
+
+            if ((ngx_msec_int_t) (deadline - now) <= 0) {
+                LOG_WARN("thread pool \"%s\" did not drain in %lu ms, "
+                         "aborting", tp->name, timeout);
+
+                ngx_thread_pool_exit(tp, NGX_THREAD_POOL_ABORT);
+                continue;
+            }
+
+            rc = ngx_thread_cond_timedwait(&tp->exit_cond, &tp->mtx,
+                                           deadline - now);
+
+        } else {
+            rc = ngx_thread_cond_wait(&tp->exit_cond, &tp->mtx);
+        }
+
+        if (rc == NGX_ERROR) {
+            (void) ngx_thread_mutex_unlock(&tp->mtx);
+            return NGX_ERROR;
+        }
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    for (n = 0; n < tp->threads; n++) {
+        worker = &tp->workers[n];
+
+        if (worker->state != NGX_THREAD_POOL_WORKER_FREE) {
+            (void) pthread_join(worker->tid, NULL);
+            worker->state = NGX_THREAD_POOL_WORKER_FREE;
+        }
+    }
+
+#if (NGX_HAVE_FUTEX)
+
+    /* a fiber's waker may still be in a post, for a few instructions */
+
+    for ( ;; ) {
+        n = ngx_atomic_load(&tp->waking);
+
+        if (n == 0) {
+            break;
+        }
+
+        (void) ngx_futex_wait(&tp->waking, (uint32_t) n, 0);
+    }
+
+#endif
+
+    while (timers) {
+        task = timers;
+        timers = task->next;
+
+        for (next = task; next; /* void */) {
+            next = ngx_thread_pool_drop(tp, next);
+        }
+    }
+
+    tp->engine->done(tp);
+
+    ngx_thread_fiber_free(tp);
+
+    (void) ngx_thread_cond_destroy(&tp->exit_cond);
+
+    (void) ngx_thread_cond_destroy(&tp->cond);
+
+    (void) ngx_thread_mutex_destroy(&tp->mtx);
+
+    free(tp->workers);
+    tp->workers = NULL;
+
+    tp->min_threads = min_threads;
+    tp->exiting = 0;
+    tp->started = 0;
+
+    if (tp->notify != -1) {
+        (void) close(tp->notify);
+        tp->notify = -1;
+    }
+
+    if (tp->dropped.first == NULL) {
+        return NGX_OK;
+    }
+
+    LOG_WARN("thread pool \"%s\" dropped queued tasks", tp->name);
+
+    if (left) {
+        *left = tp->dropped.first;
+    }
+
+    return NGX_ABORT;
+}
+
+
+/* called with tp->mtx locked */
+
+static void
+ngx_thread_pool_exit(ngx_thread_pool_t *tp, ngx_uint_t mode)
+{
+    tp->exiting = mode;
+
+    (void) ngx_thread_cond_broadcast(&tp->cond);
+
+#if (NGX_HAVE_FUTEX)
+
+    if (tp->futex_park) {
+
+        /* the barrier orders exiting before the futex word */
+
+        (void) ngx_atomic_fetch_add(&tp->futex, 1);
+
+        ngx_futex_wake(&tp->futex, tp->threads);
+    }
+
+    /* producers waiting for space see the exiting pool */
+
+    if (tp->blocked) {
+        (void) ngx_atomic_fetch_add(&tp->space, 1);
+
+        ngx_futex_wake(&tp->space, NGX_THREAD_LATCH_COUNT);
+    }
+
+#endif
+}
+
+
+//ngx_thread_task_t *
+//ngx_thread_task_alloc(size_t size)
+//{
+//    ngx_thread_task_t  *task;
+//
+//    //task = ngx_pcalloc(pool, sizeof(ngx_thread_task_t) + size);
+//    task = malloc(sizeof(ngx_thread_task_t) + size);
+//    if (task == NULL) {
+//        return NULL;
+//    }
+//
+//    task->ctx = task + 1;
+//
+//    return task;
+//}
+
+
+ngx_thread_task_t *
+ngx_thread_task_alloc(ngx_thread_pool_t *tp, size_t size)
+{
+    ngx_uint_t                i;
+    ngx_thread_task_t        *task;
+    ngx_thread_task_slab_t   *slab;
+    ngx_thread_task_cache_t  *cache;
+
+    for (i = 0; i < NGX_THREAD_TASK_SLABS; i++) {
+        if (size <= tp->slabs[i].size) {
+            break;
+        }
+    }
+
+    if (i == NGX_THREAD_TASK_SLABS) {
+        task = malloc(ngx_thread_task_header + size);
+        if (task == NULL) {
+            LOG_ERROR("malloc() failed");
+            return NULL;
+        }
+
+        slab = &ngx_thread_task_heap;
+
+    } else {
+        slab = &tp->slabs[i];
+        cache = ngx_thread_task_cache(slab);
+
+        if (cache->free == NULL && ngx_thread_task_refill(cache) != NGX_OK) {
+            return NULL;
+        }
+
+        task = cache->free;
+        cache->free = task->next;
+        cache->nfree--;
+    }
+
+    ngx_memzero(task, sizeof(ngx_thread_task_t));
+
+    task->ctx = (u_char *) task + ngx_thread_task_header;
+    task->slab = slab;
+
+    ngx_memzero(task->ctx, size);
+
+    return task;
+}
+
+
+void
+ngx_thread_task_free(ngx_thread_task_t *task)
+{
+    ngx_thread_task_slab_t   *slab;
+    ngx_thread_task_cache_t  *cache;
+
+    slab = task->slab;
+
+    if (slab == &ngx_thread_task_heap) {
+        free(task);
+        return;
+    }
+
+    cache = ngx_thread_task_cache(slab);
+
+    task->next = cache->free;
+    cache->free = task;
+    cache->nfree++;
+
+    if (cache->nfree >= 2 * NGX_THREAD_TASK_SLAB_BATCH) {
+        ngx_thread_task_flush(cache, NGX_THREAD_TASK_SLAB_BATCH);
+    }
+}
+
+
+static ngx_thread_task_cache_t *
+ngx_thread_task_cache(ngx_thread_task_slab_t *slab)
+{
+    ngx_thread_task_cache_t  *cache;
+
+    cache = &ngx_thread_task_caches[slab->index % NGX_THREAD_TASK_CACHES];
+
+    if (cache->slab == slab) {
+        return cache;
+    }
+
+    if (!ngx_thread_task_cached) {
+
+        /* return the cached tasks to their slabs when the thread exits */
+
+        (void) pthread_once(&ngx_thread_task_once, ngx_thread_task_cache_key);
+        (void) pthread_setspecific(ngx_thread_task_key,
+                                   ngx_thread_task_caches);
+
+        ngx_thread_task_cached = 1;
+    }
+
+    if (cache->nfree) {
+        ngx_thread_task_flush(cache, cache->nfree);
+    }
+
+    cache->slab = slab;
+
+    return cache;
+}
+
+
+static ngx_int_t
+ngx_thread_task_refill(ngx_thread_task_cache_t *cache)
+{
+    size_t                   size;
+    u_char                  *p;
+    ngx_uint_t               i;
+    ngx_thread_task_t       *task;
+    ngx_thread_task_slab_t  *slab;
+
+    slab = cache->slab;
+
+    if (slab->depot) {
+        ngx_spinlock(&slab->lock, 1, 2048);
+
+        task = slab->depot;
+
+        if (task) {
+            slab->depot = task->ctx;
+        }
+
+        ngx_unlock(&slab->lock);
+
+        if (task) {
+            cache->free = task;
+            cache->nfree = task->id;
+            return NGX_OK;
+        }
+    }
+
+    size = ngx_thread_task_header + slab->size;
+
+    p = malloc(NGX_THREAD_TASK_SLAB_BATCH * size);
+    if (p == NULL) {
+        LOG_ERROR("malloc() failed");
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < NGX_THREAD_TASK_SLAB_BATCH; i++) {
+        task = (ngx_thread_task_t *) (p + i * size);
+
+        task->next = cache->free;
+        cache->free = task;
+    }
+
+    cache->nfree = NGX_THREAD_TASK_SLAB_BATCH;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_task_flush(ngx_thread_task_cache_t *cache, ngx_uint_t n)
+{
+    ngx_uint_t               i;
+    ngx_thread_task_t       *first, *last;
+    ngx_thread_task_slab_t  *slab;
+
+    first = cache->free;
+
+    for (last = first, i = 1; i < n; i++) {
+        last = last->next;
+    }
+
+    cache->free = last->next;
+    cache->nfree -= n;
+
+    last->next = NULL;
+    first->id = n;
+
+    slab = cache->slab;
+
+    ngx_spinlock(&slab->lock, 1, 2048);
+
+    first->ctx = slab->depot;
+    slab->depot = first;
+
+    ngx_unlock(&slab->lock);
+}
+
+
+static void
+ngx_thread_task_cache_exit(void *data)
+{
+    ngx_thread_task_cache_t *caches = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_THREAD_TASK_CACHES; i++) {
+        if (caches[i].nfree) {
+            ngx_thread_task_flush(&caches[i], caches[i].nfree);
+        }
+
+        caches[i].slab = NULL;
+    }
+
+    ngx_thread_task_cached = 0;
+}
+
+
+static void
+ngx_thread_task_cache_key(void)
+{
+    if (pthread_key_create(&ngx_thread_task_key, ngx_thread_task_cache_exit)
+        != 0)
+    {
+        LOG_ERROR("pthread_key_create() failed");
+    }
+}
+
+
+ngx_int_t
+ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_thread_pool_post(tp, task);
+
+    ngx_thread_pool_count(tp, rc, 1);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_thread_task_t         *prev;
+    ngx_thread_pool_worker_t  *worker;
+
+    //if (task->event.active) {
+        //ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
+        //              "task #%ui already active", task->id);
+        //return NGX_ERROR;
+    //}
+
+    if (tp->exiting == NGX_THREAD_POOL_ABORT) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the state of a task with predecessors is set by depend(), and one
+     * that failed before the task was posted has already withdrawn it
+     */
+
+    if (task->deps == 0) {
+        task->state = NGX_THREAD_TASK_QUEUED;
+    }
+
+    task->status = NGX_THREAD_TASK_DONE;
+    task->pool = tp;
+
+    if (ngx_thread_pool_timed(tp)) {
+        task->queued = ngx_monotonic_usec();
+    }
+
+    /* a task with predecessors is queued by the last one to finish */
+
+    if (task->deps && ngx_atomic_fetch_add(&task->deps, -1) != 1) {
+        return NGX_OK;
+    }
+
+    worker = ngx_thread_pool_current;
+
+    if (worker == NULL || worker->tp != tp) {
+        return tp->engine->post(tp, task);
+    }
+
+    prev = worker->lifo;
+
+    /*
+     * the slot counts against max_queue like the queue itself: either
+     * the task it holds has to fit into the queue, or the queue must
+     * have room for one more task
+     */
+
+    if (prev) {
+        if (tp->engine->post(tp, prev) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else if (tp->engine->depth(tp) >= (ngx_uint_t) tp->max_queue) {
+        return NGX_ERROR;
+    }
+
+    task->id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, 1);
+    task->next = NULL;
+
+    worker->lifo = task;
+
+    return NGX_OK;
+}
+
+
+/*
+ * only the owner runs the task in its slot, so a worker about to sleep
+ * on a latch or a full queue moves the task to the queue: a handler that
+ * posts a task to its own pool and then waits for it would deadlock
+ * otherwise
+ */
+
+static void
+ngx_thread_pool_flush(void)
+{
+    ngx_thread_task_t         *task;
+    ngx_thread_pool_worker_t  *worker;
+
+    worker = ngx_thread_pool_current;
+
+    if (worker == NULL || worker->lifo == NULL) {
+        return;
+    }
+
+    task = worker->lifo;
+
+    if (worker->tp->engine->post(worker->tp, task) == NGX_OK) {
+        worker->lifo = NULL;
+    }
+}
+
+
+ngx_int_t
+ngx_thread_task_post_delayed(ngx_thread_pool_t *tp, ngx_thread_task_t *task,
+    ngx_msec_t delay)
+{
+    task->period = 0;
+
+    return ngx_thread_pool_post_timer(tp, task, delay);
+}
+
+
+ngx_int_t
+ngx_thread_task_post_periodic(ngx_thread_pool_t *tp, ngx_thread_task_t *task,
+    ngx_msec_t delay, ngx_msec_t period)
+{
+    if (period == 0) {
+        return NGX_ERROR;
+    }
+
+    task->period = period;
+
+    return ngx_thread_pool_post_timer(tp, task, delay);
+}
+
+
+static ngx_int_t
+ngx_thread_pool_post_timer(ngx_thread_pool_t *tp, ngx_thread_task_t *task,
+    ngx_msec_t delay)
+{
+    ngx_int_t  rc;
+
+    if (delay == 0) {
+
+        /* a periodic task is timed from its first run on */
+
+        task->timer = ngx_monotonic_msec();
+
+        rc = ngx_thread_pool_post(tp, task);
+
+    } else {
+        task->state = NGX_THREAD_TASK_QUEUED;
+        task->status = NGX_THREAD_TASK_DONE;
+        task->pool = tp;
+        task->timer = ngx_monotonic_msec() + delay;
+
+        rc = ngx_thread_pool_timer_add(tp, task);
+    }
+
+    ngx_thread_pool_count(tp, rc, 1);
+
+    return rc;
+}
+
+
+/* returns 1 if the periodic task has been armed for its next run */
+
+static ngx_uint_t
+ngx_thread_pool_rearm(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_uint_t  rc;
+
+    /* the next run is due a period after the last one was */
+
+    task->timer += task->period;
+
+    if ((ngx_msec_int_t) (task->timer - ngx_monotonic_msec()) <= 0) {
+        task->timer = ngx_monotonic_msec() + task->period;
+    }
+
+    (void) ngx_thread_mutex_lock(&tp->wheel.mtx);
+
+    rc = 0;
+
+    if (!tp->wheel.closed
+        && ngx_atomic_cmp_set(&task->state, NGX_THREAD_TASK_STARTED,
+                              NGX_THREAD_TASK_QUEUED))
+    {
+        if (ngx_thread_pool_timer_arm(tp, task) == NGX_OK) {
+            rc = 1;
+
+        } else {
+            task->state = NGX_THREAD_TASK_STARTED;
+        }
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->wheel.mtx);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_timer_add(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_int_t                 rc;
+    ngx_thread_pool_wheel_t  *wheel;
+
+    wheel = &tp->wheel;
+
+    if (ngx_thread_mutex_lock(&wheel->mtx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (wheel->closed || tp->exiting) {
+        (void) ngx_thread_mutex_unlock(&wheel->mtx);
+        return NGX_ERROR;
+    }
+
+    rc = ngx_thread_pool_timer_arm(tp, task);
+
+    (void) ngx_thread_mutex_unlock(&wheel->mtx);
+
+    return rc;
+}
+
+
+/*
+ * called with the wheel locked, starts the timer thread with the first
+ * task armed, be it a delayed one or a periodic one posted without delay
+ */
+
+static ngx_int_t
+ngx_thread_pool_timer_arm(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    int                       err;
+    ngx_thread_pool_wheel_t  *wheel;
+
+    wheel = &tp->wheel;
+
+    if (!wheel->running) {
+        err = pthread_create(&wheel->tid, NULL, ngx_thread_pool_timer, tp);
+        if (err) {
+            LOG_ERROR("pthread_create() failed");
+            return NGX_ERROR;
+        }
+
+        wheel->running = 1;
+    }
+
+    /* an empty wheel has not run for a while */
+
+    if (wheel->count == 0) {
+        wheel->now = ngx_monotonic_msec();
+    }
+
+    ngx_thread_wheel_add(wheel, task);
+
+    if (wheel->wakeup == 0
+        || (ngx_msec_int_t) (task->timer - wheel->wakeup) < 0)
+    {
+        (void) ngx_thread_cond_signal(&wheel->cond);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * the timer thread moves due tasks to the queue, a task the queue has no
+ * room for is retried on the next tick
+ */
+
+static void *
+ngx_thread_pool_timer(void *data)
+{
+    ngx_thread_pool_t *tp = data;
+
+    sigset_t                  set;
+    ngx_msec_t                now, next;
+    ngx_thread_task_t        *task, *due;
+    ngx_thread_pool_wheel_t  *wheel;
+
+    wheel = &tp->wheel;
+
+    sigfillset(&set);
+    (void) pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (ngx_thread_mutex_lock(&wheel->mtx) != NGX_OK) {
+        return NULL;
+    }
+
+    while (!wheel->closed) {
+
+        now = ngx_monotonic_msec();
+
+        due = ngx_thread_wheel_run(wheel, now);
+
+        if (due) {
+            (void) ngx_thread_mutex_unlock(&wheel->mtx);
+
+            while (due) {
+                task = due;
+                due = task->next;
+
+                if (ngx_thread_pool_timed(tp)) {
+                    task->queued = ngx_monotonic_usec();
+                }
+
+                if (tp->engine->post(tp, task) == NGX_OK) {
+                    continue;
+                }
+
+                (void) ngx_thread_mutex_lock(&wheel->mtx);
+
+                task->timer = wheel->now + 1;
+                ngx_thread_wheel_add(wheel, task);
+
+                (void) ngx_thread_mutex_unlock(&wheel->mtx);
+            }
+
+            (void) ngx_thread_mutex_lock(&wheel->mtx);
+
+            continue;
+        }
+
+        if (wheel->count == 0) {
+            wheel->wakeup = 0;
+
+            (void) ngx_thread_cond_wait(&wheel->cond, &wheel->mtx);
+            continue;
+        }
+
+        next = ngx_thread_wheel_next(wheel);
+        wheel->wakeup = next;
+
+        if ((ngx_msec_int_t) (next - now) > 0) {
+            (void) ngx_thread_cond_timedwait(&wheel->cond, &wheel->mtx,
+                                             next - now);
+        }
+    }
+
+    (void) ngx_thread_mutex_unlock(&wheel->mtx);
+
+    return NULL;
+}
+
+
+/* stops the timer thread and returns the tasks left in the wheel */
+
+static ngx_thread_task_t *
+ngx_thread_pool_timer_close(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t                level, slot;
+    ngx_thread_task_t        *timers, *task;
+    ngx_thread_pool_wheel_t  *wheel;
+
+    wheel = &tp->wheel;
+
+    (void) ngx_thread_mutex_lock(&wheel->mtx);
+
+    wheel->closed = 1;
+
+    (void) ngx_thread_cond_signal(&wheel->cond);
+
+    (void) ngx_thread_mutex_unlock(&wheel->mtx);
+
+    if (wheel->running) {
+        (void) pthread_join(wheel->tid, NULL);
+        wheel->running = 0;
+    }
+
+    timers = NULL;
+
+    for (level = 0; level < NGX_THREAD_TIMER_LEVELS; level++) {
+        for (slot = 0; slot < NGX_THREAD_TIMER_SLOTS; slot++) {
+
+            while (wheel->slots[level][slot]) {
+                task = wheel->slots[level][slot];
+                wheel->slots[level][slot] = task->next;
+
+                task->next = timers;
+                timers = task;
+            }
+        }
+
+        wheel->used[level] = 0;
+    }
+
+    wheel->count = 0;
+    wheel->wakeup = 0;
+
+    return timers;
+}
+
+
+/* called with the wheel locked */
+
+static void
+ngx_thread_wheel_add(ngx_thread_pool_wheel_t *wheel, ngx_thread_task_t *task)
+{
+    ngx_uint_t  level, slot;
+    ngx_msec_t  timer, delta;
+
+    timer = task->timer;
+
+    /* a task due already goes to the next tick */
+
+    if ((ngx_msec_int_t) (timer - wheel->now) <= 0) {
+        timer = wheel->now + 1;
+    }
+
+    delta = timer - wheel->now;
+
+    if (delta >= NGX_THREAD_TIMER_SPAN) {
+        timer = wheel->now + NGX_THREAD_TIMER_SPAN - 1;
+        delta = NGX_THREAD_TIMER_SPAN - 1;
+    }
+
+    for (level = 0; level < NGX_THREAD_TIMER_LEVELS - 1; level++) {
+        if (delta < (ngx_msec_t) 1 << (NGX_THREAD_TIMER_BITS * (level + 1)))
+        {
+            break;
+        }
+    }
+
+    slot = (timer >> (NGX_THREAD_TIMER_BITS * level))
+           & (NGX_THREAD_TIMER_SLOTS - 1);
+
+    task->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = task;
+
+    wheel->used[level] |= (uint64_t) 1 << slot;
+    wheel->count++;
+}
+
+
+/*
+ * the time the wheel next handles a used slot: the first used slot past
+ * the current one on each level, the current one itself being a whole
+ * turn away
+ */
+
+static ngx_msec_t
+ngx_thread_wheel_next(ngx_thread_pool_wheel_t *wheel)
+{
+    uint64_t    used;
+    ngx_uint_t  level, shift, cur;
+    ngx_msec_t  next, t;
+
+    next = NGX_TIMER_INFINITE;
+
+    for (level = 0; level < NGX_THREAD_TIMER_LEVELS; level++) {
+        used = wheel->used[level];
+
+        if (used == 0) {
+            continue;
+        }
+
+        shift = NGX_THREAD_TIMER_BITS * level;
+        cur = ((wheel->now >> shift) + 1) & (NGX_THREAD_TIMER_SLOTS - 1);
+
+        /* bit 0 is the slot after the current one */
+
+        if (cur) {
+            used = (used >> cur) | (used << (NGX_THREAD_TIMER_SLOTS - cur));
+        }
+
+        t = ((wheel->now >> shift) + __builtin_ctzll(used) + 1) << shift;
+
+        if (t < next) {
+            next = t;
+        }
+    }
+
+    return next;
+}
+
+
+/*
+ * runs the wheel up to now: slots of higher levels are moved down as they
+ * are reached, and the tasks due are returned as a chain
+ */
+
+static ngx_thread_task_t *
+ngx_thread_wheel_run(ngx_thread_pool_wheel_t *wheel, ngx_msec_t now)
+{
+    ngx_int_t           level;
+    ngx_uint_t          slot, shift;
+    ngx_msec_t          t;
+    ngx_thread_task_t  *task, *list, *due;
+
+    due = NULL;
+
+    while ((ngx_msec_int_t) (now - wheel->now) > 0) {
+
+        t = wheel->count ? ngx_thread_wheel_next(wheel) : NGX_TIMER_INFINITE;
+
+        if (t > now) {
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now = t;
+
+        for (level = NGX_THREAD_TIMER_LEVELS - 1; level >= 0; level--) {
+            shift = NGX_THREAD_TIMER_BITS * level;
+
+            if (t & (((ngx_msec_t) 1 << shift) - 1)) {
+                continue;
+            }
+
+            slot = (t >> shift) & (NGX_THREAD_TIMER_SLOTS - 1);
+
+            if (!(wheel->used[level] & ((uint64_t) 1 << slot))) {
+                continue;
+            }
+
+            list = wheel->slots[level][slot];
+
+            wheel->slots[level][slot] = NULL;
+            wheel->used[level] &= ~((uint64_t) 1 << slot);
+
+            while (list) {
+                task = list;
+                list = task->next;
+
+                wheel->count--;
+
+                if ((ngx_msec_int_t) (task->timer - t) <= 0) {
+                    task->next = due;
+                    due = task;
+
+                } else {
+                    ngx_thread_wheel_add(wheel, task);
+                }
+            }
+        }
+    }
+
+    return due;
+}
+
+
+ngx_int_t
+ngx_thread_task_try_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task,
+    ngx_uint_t *depth)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_thread_pool_post(tp, task);
+
+    ngx_thread_pool_count(tp, rc, 1);
+
+    if (depth) {
+        *depth = tp->engine->depth(tp);
+    }
+
+    if (rc == NGX_ERROR && tp->exiting != NGX_THREAD_POOL_ABORT) {
+        return NGX_BUSY;
+    }
+
+    return rc;
+}
+
+
+#if (NGX_HAVE_FUTEX)
+
+ngx_int_t
+ngx_thread_task_post_wait(ngx_thread_pool_t *tp, ngx_thread_task_t *task,
+    ngx_msec_t timeout)
+{
+    uint32_t    seq;
+    ngx_int_t   rc;
+    ngx_msec_t  deadline, wait;
+
+    deadline = ngx_monotonic_msec() + timeout;
+
+    for ( ;; ) {
+        if (ngx_thread_pool_post(tp, task) == NGX_OK) {
+            ngx_thread_pool_count(tp, NGX_OK, 1);
+            return NGX_OK;
+        }
+
+        if (tp->exiting) {
+            ngx_thread_pool_count(tp, NGX_ERROR, 1);
+            return NGX_ERROR;
+        }
+
+        if (timeout == NGX_TIMER_INFINITE) {
+            wait = 0;
+
+        } else {
+            wait = deadline - ngx_monotonic_msec();
+
+            if (timeout == 0 || (ngx_msec_int_t) wait <= 0) {
+                ngx_thread_pool_count(tp, NGX_AGAIN, 1);
+                return NGX_AGAIN;
+            }
+        }
+
+        /*
+         * the barrier of the increment pairs with the one in
+         * ngx_thread_pool_space(): either the retry finds the space,
+         * or the worker that made it sees us blocked
+         */
+
+        seq = ngx_atomic_load(&tp->space);
+
+        (void) ngx_atomic_fetch_add(&tp->blocked, 1);
+
+        if (ngx_thread_pool_post(tp, task) == NGX_OK) {
+            (void) ngx_atomic_fetch_add(&tp->blocked, -1);
+            ngx_thread_pool_count(tp, NGX_OK, 1);
+            return NGX_OK;
+        }
+
+        ngx_thread_pool_flush();
+
+        rc = ngx_futex_wait(&tp->space, seq, wait);
+
+        (void) ngx_atomic_fetch_add(&tp->blocked, -1);
+
+        if (rc == NGX_ERROR) {
+            ngx_thread_pool_count(tp, NGX_ERROR, 1);
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+/* a worker has taken a task off the queue */
+
+static void
+ngx_thread_pool_space(ngx_thread_pool_t *tp)
+{
+    ngx_memory_barrier();
+
+    if (tp->blocked == 0) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->space, 1);
+
+    ngx_futex_wake(&tp->space, 1);
+}
+
+#endif
+
+
+ngx_int_t
+ngx_thread_task_post_batch(ngx_thread_pool_t *tp, ngx_thread_task_t **tasks,
+    ngx_uint_t n)
+{
+    uint64_t    now;
+    ngx_int_t   rc;
+    ngx_uint_t  i;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    if (tp->exiting == NGX_THREAD_POOL_ABORT) {
+        ngx_thread_pool_count(tp, NGX_ERROR, n);
+        return NGX_ERROR;
+    }
+
+    now = ngx_thread_pool_timed(tp) ? ngx_monotonic_usec() : 0;
+
+    for (i = 0; i < n; i++) {
+        tasks[i]->next = (i < n - 1) ? tasks[i + 1] : NULL;
+        tasks[i]->state = NGX_THREAD_TASK_QUEUED;
+        tasks[i]->status = NGX_THREAD_TASK_DONE;
+        tasks[i]->pool = tp;
+        tasks[i]->queued = now;
+    }
+
+    rc = tp->engine->post_chain(tp, tasks[0], n);
+
+    ngx_thread_pool_count(tp, rc, n);
+
+    return rc;
+}
+
+
+ngx_int_t
+ngx_thread_task_post_chain(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    uint64_t            now;
+    ngx_int_t           rc;
+    ngx_uint_t          n;
+    ngx_thread_task_t  *t;
+
+    n = 0;
+    now = ngx_thread_pool_timed(tp) ? ngx_monotonic_usec() : 0;
+
+    for (t = task; t; t = t->next) {
+        t->state = NGX_THREAD_TASK_QUEUED;
+        t->status = NGX_THREAD_TASK_DONE;
+        t->pool = tp;
+        t->queued = now;
+        n++;
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    if (tp->exiting == NGX_THREAD_POOL_ABORT) {
+        ngx_thread_pool_count(tp, NGX_ERROR, n);
+        return NGX_ERROR;
+    }
+
+    rc = tp->engine->post_chain(tp, task, n);
+
+    ngx_thread_pool_count(tp, rc, n);
+
+    return rc;
+}
+
+
+void
+ngx_thread_strand_init(ngx_thread_strand_t *strand, ngx_thread_pool_t *tp)
+{
+    ngx_memzero(strand, sizeof(ngx_thread_strand_t));
+
+    strand->pool = tp;
+    strand->last = &strand->first;
+
+    strand->task.ctx = strand;
+    strand->task.state = NGX_THREAD_TASK_STRAND;
+}
+
+
+ngx_int_t
+ngx_thread_strand_post(ngx_thread_strand_t *strand, ngx_thread_task_t *task)
+{
+    ngx_int_t           rc;
+    ngx_uint_t          post;
+    ngx_thread_pool_t  *tp;
+
+    tp = strand->pool;
+
+    if (tp->exiting == NGX_THREAD_POOL_ABORT) {
+        ngx_thread_pool_count(tp, NGX_ERROR, 1);
+        return NGX_ERROR;
+    }
+
+    task->state = NGX_THREAD_TASK_QUEUED;
+    task->status = NGX_THREAD_TASK_DONE;
+    task->pool = tp;
+    task->next = NULL;
+    task->id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, 1);
+
+    if (ngx_thread_pool_timed(tp)) {
+        task->queued = ngx_monotonic_usec();
+    }
+
+    ngx_spinlock(&strand->lock, 1, 2048);
+
+    *strand->last = task;
+    strand->last = &task->next;
+
+    /* an idle strand is marked busy here and queued after the unlock */
+
+    post = !strand->busy;
+    strand->busy = 1;
+
+    ngx_unlock(&strand->lock);
+
+    if (!post) {
+        ngx_thread_pool_count(tp, NGX_OK, 1);
+        return NGX_OK;
+    }
+
+    rc = tp->engine->post(tp, &strand->task);
+
+    if (rc != NGX_OK) {
+
+        /*
+         * the strand was idle, so the task is its first one; tasks posted
+         * meanwhile have been accepted, the strand has to be queued for
+         * them once a worker has made room
+         */
+
+        ngx_spinlock(&strand->lock, 1, 2048);
+
+        strand->first = task->next;
+
+        if (strand->first == NULL) {
+            strand->last = &strand->first;
+            strand->busy = 0;
+        }
+
+        post = strand->busy;
+
+        ngx_unlock(&strand->lock);
+
+        task->next = NULL;
+
+        if (post) {
+            ngx_thread_strand_resume(strand, NULL);
+        }
+    }
+
+    ngx_thread_pool_count(tp, rc, 1);
+
+    return rc;
+}
+
+
+void
+ngx_thread_strand_resume(ngx_thread_strand_t *strand, ngx_thread_task_t *task)
+{
+    ngx_thread_pool_t  *tp;
+
+    tp = strand->pool;
+
+    if (task) {
+        task->state = NGX_THREAD_TASK_QUEUED;
+        task->status = NGX_THREAD_TASK_DONE;
+        task->pool = tp;
+        task->id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, 1);
+
+        if (ngx_thread_pool_timed(tp)) {
+            task->queued = ngx_monotonic_usec();
+        }
+
+        ngx_spinlock(&strand->lock, 1, 2048);
+
+        task->next = strand->first;
+        strand->first = task;
+
+        if (task->next == NULL) {
+            strand->last = &task->next;
+        }
+
+        ngx_unlock(&strand->lock);
+    }
+
+    /* the tasks have been accepted, so the strand waits for room */
+
+    ngx_thread_pool_requeue(tp, &strand->task);
+}
+
+
+ngx_int_t
+ngx_thread_strands_init(ngx_thread_strands_t *strands, ngx_thread_pool_t *tp,
+    ngx_uint_t n)
+{
+    ngx_uint_t  i, size;
+
+    for (size = 1; size < n; size <<= 1) { /* void */ }
+
+    strands->strand = malloc(size * sizeof(ngx_thread_strand_t));
+    if (strands->strand == NULL) {
+        LOG_ERROR("malloc(%lu) failed", size * sizeof(ngx_thread_strand_t));
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < size; i++) {
+        ngx_thread_strand_init(&strands->strand[i], tp);
+    }
+
+    strands->mask = size - 1;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_thread_strands_post(ngx_thread_strands_t *strands, ngx_uint_t key,
+    ngx_thread_task_t *task)
+{
+    uint64_t  hash;
+
+    /* Fibonacci hashing spreads sequential keys over the strands */
+
+    hash = (uint64_t) key * 0x9e3779b97f4a7c15ULL;
+
+    return ngx_thread_strand_post(&strands->strand[(hash >> 32)
+                                                   & strands->mask],
+                                  task);
+}
+
+
+ngx_int_t
+ngx_thread_task_depend(ngx_thread_task_t *task, ngx_thread_task_t *pred)
+{
+    if (pred->successor) {
+        LOG_ERROR("task already has a successor");
+        return NGX_ERROR;
+    }
+
+    /* one more count keeps the task from being queued until it is posted */
+
+    if (task->deps == 0) {
+        task->deps = 1;
+        task->state = NGX_THREAD_TASK_QUEUED;
+    }
+
+    task->deps++;
+    pred->successor = task;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_thread_task_claim(ngx_thread_task_t *task)
+{
+    if (ngx_atomic_cmp_set(&task->state, NGX_THREAD_TASK_QUEUED,
+                           NGX_THREAD_TASK_STARTED))
+    {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_thread_task_cancel(ngx_thread_task_t *task)
+{
+    if (ngx_atomic_cmp_set(&task->state, NGX_THREAD_TASK_QUEUED,
+                           NGX_THREAD_TASK_WITHDRAWN))
+    {
+        return NGX_OK;
+    }
+
+    /* a periodic task that is running now is not armed again */
+
+    if (task->period
+        && ngx_atomic_cmp_set(&task->state, NGX_THREAD_TASK_STARTED,
+                              NGX_THREAD_TASK_WITHDRAWN))
+    {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+void
+ngx_thread_task_yield(void)
+{
+    ngx_thread_pool_worker_t  *worker;
+
+    worker = ngx_thread_pool_current;
+
+    if (worker == NULL || worker->fiber == NULL) {
+        ngx_sched_yield();
+        return;
+    }
+
+    ngx_thread_fiber_suspend(worker->fiber, NULL);
+}
+
+
+#if (NGX_HAVE_FUTEX)
+
+void
+ngx_thread_future_init(ngx_thread_future_t *future)
+{
+    ngx_thread_latch_init(&future->latch, 0);
+    future->pending = 0;
+    future->status = NGX_THREAD_TASK_DONE;
+    future->then = NULL;
+    future->lock = 0;
+}
+
+
+ngx_int_t
+ngx_thread_task_post_future(ngx_thread_pool_t *tp, ngx_thread_task_t *task,
+    ngx_thread_future_t *future)
+{
+    /* the latch is held once for all pending tasks */
+
+    if (ngx_atomic_fetch_add(&future->pending, 1) == 0) {
+        ngx_thread_latch_add(&future->latch, 1);
+    }
+
+    task->future = future;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        task->future = NULL;
+        ngx_thread_future_complete(future, NGX_THREAD_TASK_CANCELLED);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_thread_future_wait(ngx_thread_future_t *future, ngx_msec_t timeout)
+{
+    ngx_thread_pool_worker_t  *worker;
+
+    worker = ngx_thread_pool_current;
+
+    if (worker && worker->fiber && timeout == NGX_TIMER_INFINITE
+        && !ngx_thread_future_done(future))
+    {
+        /* resumed once the latch is released */
+
+        ngx_thread_fiber_suspend(worker->fiber, future);
+
+        return NGX_OK;
+    }
+
+    return ngx_thread_latch_wait(&future->latch, timeout);
+}
+
+
+ngx_int_t
+ngx_thread_future_then(ngx_thread_future_t *future, ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task)
+{
+    task->pool = tp;
+
+    ngx_spinlock(&future->lock, 1, 2048);
+
+    if (future->pending == 0) {
+        ngx_unlock(&future->lock);
+        return ngx_thread_task_post(tp, task);
+    }
+
+    task->next = future->then;
+    future->then = task;
+
+    ngx_unlock(&future->lock);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_future_complete(ngx_thread_future_t *future, ngx_uint_t status)
+{
+    ngx_thread_task_t  *task, *next, *prev, *fibers;
+
+    if (status != NGX_THREAD_TASK_DONE) {
+        future->status = status;
+    }
+
+    if (ngx_atomic_fetch_add(&future->pending, -1) != 1) {
+        return;
+    }
+
+    /*
+     * a task of the group posted meanwhile keeps the continuations
+     * for the time the group completes again
+     */
+
+    task = NULL;
+
+    ngx_spinlock(&future->lock, 1, 2048);
+
+    if (future->pending == 0) {
+        task = future->then;
+        future->then = NULL;
+    }
+
+    ngx_unlock(&future->lock);
+
+    /* post continuations in the order they were added */
+
+    prev = NULL;
+    fibers = NULL;
+
+    while (task) {
+        next = task->next;
+        task->next = prev;
+        prev = task;
+        task = next;
+    }
+
+    for (task = prev; task; task = next) {
+        next = task->next;
+        task->next = NULL;
+
+        if (task->state == NGX_THREAD_TASK_FIBER) {
+            task->next = fibers;
+            fibers = task;
+            continue;
+        }
+
+        if (ngx_thread_task_post(task->pool, task) != NGX_OK) {
+            LOG_ERROR("thread pool \"%s\" rejected a continuation",
+                      task->pool->name);
+        }
+    }
+
+    /* the future may be gone once the latch is released */
+
+    (void) ngx_thread_latch_count_down(&future->latch);
+
+    /* so waiting fibers are resumed after that */
+
+    for (task = fibers; task; task = next) {
+        next = task->next;
+        ngx_thread_fiber_wake(task->pool, task->ctx);
+    }
+}
+
+#endif
+
+
+static void
+ngx_thread_pool_chain_ids(ngx_thread_task_t *task, ngx_uint_t n)
+{
+    ngx_uint_t  id;
+
+    id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, n);
+
+    for ( /* void */ ; task; task = task->next) {
+        task->id = id++;
+    }
+}
+
+
+static void
+ngx_thread_pool_wake(ngx_thread_pool_t *tp, ngx_uint_t n)
+{
+    /*
+     * pairs with the barrier in the engines' get(): either a worker sees
+     * the queued tasks, or we see the worker counted as idle
+     */
+
+    ngx_memory_barrier();
+
+#if (NGX_HAVE_FUTEX)
+
+    if (tp->futex_park) {
+        if (tp->parked == 0) {
+            return;
+        }
+
+        (void) ngx_atomic_fetch_add(&tp->futex, 1);
+
+        ngx_futex_wake(&tp->futex, n);
+
+        return;
+    }
+
+#endif
+
+    if (tp->idle == 0) {
+        return;
+    }
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return;
+    }
+
+    if (n > tp->idle) {
+        n = tp->idle;
+    }
+
+    while (n--) {
+        (void) ngx_thread_cond_signal(&tp->cond);
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+}
+
+
+/*
+ * queues the task of a fiber or a strand, which has been accepted already:
+ * if the queue is full or closed, it waits in the pool's woken list, which
+ * workers look at before the queue
+ */
+
+static void
+ngx_thread_pool_requeue(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_thread_task_t  *first;
+
+    task->next = NULL;
+
+    if (tp->engine->post(tp, task) == NGX_OK) {
+        return;
+    }
+
+    do {
+        first = tp->woken;
+        task->next = first;
+    } while (!ngx_atomic_cmp_set(&tp->woken, first, task));
+
+    ngx_thread_pool_wake(tp, 1);
+}
+
+
+/* takes the woken list, keeps its first task and requeues the others */
+
+static ngx_thread_task_t *
+ngx_thread_pool_woken(ngx_thread_pool_t *tp)
+{
+    ngx_thread_task_t  *task, *next, *rest;
+
+    task = ngx_atomic_swap(&tp->woken, NULL);
+
+    if (task == NULL) {
+        return NULL;
+    }
+
+    for (rest = task->next; rest; rest = next) {
+        next = rest->next;
+        ngx_thread_pool_requeue(tp, rest);
+    }
+
+    task->next = NULL;
+
+    return task;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_list_init(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_THREAD_TASK_PRIORITIES; i++) {
+        ngx_thread_pool_queue_init(&tp->queue[i]);
+        tp->skipped[i] = 0;
+    }
+
+    tp->levels = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_pool_list_done(ngx_thread_pool_t *tp)
+{
+    /* the list lives in the pool itself */
+
+    (void) tp;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_list_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (tp->waiting >= tp->max_queue) {
+        (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+        //ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+        //              "thread pool \"%V\" queue overflow: %i tasks waiting",
+        //              &tp->name, tp->waiting);
+        return NGX_ERROR;
+    }
+
+    //task->event.active = 1;
+
+    task->id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, 1);
+
+    /* no worker to wake up unless one is waiting */
+
+    if (tp->idle && !tp->futex_park
+        && ngx_thread_cond_signal(&tp->cond) != NGX_OK)
+    {
+        (void) ngx_thread_mutex_unlock(&tp->mtx);
+        return NGX_ERROR;
+    }
+
+    ngx_thread_pool_list_add(tp, task);
+
+    tp->waiting++;
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    if (tp->futex_park) {
+        ngx_thread_pool_wake(tp, 1);
+    }
+
+    //ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+    //               "task #%ui added to thread pool \"%V\"",
+    //               task->id, &tp->name);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_list_post_chain(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_uint_t n)
+{
+    ngx_uint_t          i;
+    ngx_thread_task_t  *next;
+
+    ngx_thread_pool_chain_ids(task, n);
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (tp->waiting + (ngx_int_t) n > tp->max_queue) {
+        (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+        //ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+        //              "thread pool \"%V\" queue overflow: %i tasks waiting",
+        //              &tp->name, tp->waiting);
+        return NGX_ERROR;
+    }
+
+    while (task) {
+        next = task->next;
+        ngx_thread_pool_list_add(tp, task);
+        task = next;
+    }
+
+    tp->waiting += n;
+
+    i = (n < tp->idle) ? n : tp->idle;
+
+    while (i-- && !tp->futex_park) {
+        (void) ngx_thread_cond_signal(&tp->cond);
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    if (tp->futex_park) {
+        ngx_thread_pool_wake(tp, n);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_list_get(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker)
+{
+    ngx_int_t           rc;
+    ngx_thread_task_t  *task;
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NULL;
+    }
+
+    /* the number may become negative */
+    tp->waiting--;
+
+    rc = NGX_OK;
+
+    while (tp->levels == 0) {
+
+        if (tp->exiting) {
+            tp->waiting++;
+            (void) ngx_thread_mutex_unlock(&tp->mtx);
+            return NULL;
+        }
+
+        if (rc == NGX_AGAIN && ngx_thread_pool_retire(tp, worker)) {
+            tp->waiting++;
+            (void) ngx_thread_mutex_unlock(&tp->mtx);
+            return NULL;
+        }
+
+        tp->idle++;
+
+        rc = ngx_thread_pool_park(tp);
+
+        tp->idle--;
+
+        if (rc == NGX_ERROR) {
+            (void) ngx_thread_mutex_unlock(&tp->mtx);
+            return NULL;
+        }
+    }
+
+    task = ngx_thread_pool_list_take(tp);
+
+    if (ngx_thread_mutex_unlock(&tp->mtx) != NGX_OK) {
+        return NULL;
+    }
+
+    return task;
+}
+
+
+static void
+ngx_thread_pool_list_add(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_uint_t  level;
+
+    level = task->priority;
+
+    if (level >= NGX_THREAD_TASK_PRIORITIES) {
+        level = NGX_THREAD_TASK_PRIORITIES - 1;
+    }
+
+    task->next = NULL;
+
+    *tp->queue[level].last = task;
+    tp->queue[level].last = &task->next;
+
+    tp->levels |= 1 << level;
+}
+
+
+/*
+ * the highest non-empty class is served first; a lower class that has
+ * been passed over "aging" times while it had tasks is served next
+ */
+
+static ngx_thread_task_t *
+ngx_thread_pool_list_take(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t                level, top, i;
+    ngx_thread_task_t        *task;
+    ngx_thread_pool_queue_t  *q;
+
+    for (top = NGX_THREAD_TASK_PRIORITIES - 1; top; top--) {
+        if (tp->levels & (1 << top)) {
+            break;
+        }
+    }
+
+    level = top;
+
+    if (tp->aging) {
+        for (i = 0; i < top; i++) {
+            if ((tp->levels & (1 << i)) && tp->skipped[i] >= tp->aging) {
+                level = i;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < NGX_THREAD_TASK_PRIORITIES; i++) {
+        if (i != level && (tp->levels & (1 << i))) {
+            tp->skipped[i]++;
+        }
+    }
+
+    tp->skipped[level] = 0;
+
+    q = &tp->queue[level];
+
+    task = q->first;
+    q->first = task->next;
+
+    if (q->first == NULL) {
+        q->last = &q->first;
+        tp->levels &= ~(1 << level);
+    }
+
+    return task;
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_list_depth(ngx_thread_pool_t *tp)
+{
+    ngx_int_t  n;
+
+    /* each parked worker has already taken one off the waiting count */
+
+    n = tp->waiting + (ngx_int_t) tp->idle;
+
+    return (n > 0) ? n : 0;
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_list_ready(ngx_thread_pool_t *tp)
+{
+    return ngx_atomic_load(&tp->levels);
+}
+
+
+static ngx_int_t
+ngx_thread_pool_ring_init(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t               i, n;
+    ngx_thread_pool_ring_t  *ring;
+
+    ring = &tp->ring;
+
+    for (n = 2; n < (ngx_uint_t) tp->max_queue; n <<= 1) { /* void */ }
+
+    ring->cells = malloc(n * sizeof(ngx_thread_pool_cell_t));
+    if (ring->cells == NULL) {
+        LOG_ERROR("malloc(%lu) failed", n * sizeof(ngx_thread_pool_cell_t));
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        ring->cells[i].seq = i;
+        ring->cells[i].task = NULL;
+    }
+
+    ring->mask = n - 1;
+    ring->tail = 0;
+    ring->head = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_pool_ring_done(ngx_thread_pool_t *tp)
+{
+    free(tp->ring.cells);
+    tp->ring.cells = NULL;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_ring_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    task->id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, 1);
+    task->next = NULL;
+
+    if (ngx_thread_pool_ring_push(&tp->ring, task) != NGX_OK) {
+        //ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+        //              "thread pool \"%V\" queue overflow", &tp->name);
+        return NGX_ERROR;
+    }
+
+    ngx_thread_pool_wake(tp, 1);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_ring_post_chain(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_uint_t n)
+{
+    ngx_uint_t               i;
+    ngx_atomic_uint_t        pos, head;
+    ngx_thread_task_t       *next;
+    ngx_thread_pool_ring_t  *ring;
+    ngx_thread_pool_cell_t  *cell;
+
+    ring = &tp->ring;
+
+    ngx_thread_pool_chain_ids(task, n);
+
+    /*
+     * reserve n consecutive positions at once; the cells below head
+     * are already claimed by workers and are released momentarily
+     */
+
+    for ( ;; ) {
+        pos = ring->tail;
+        head = ngx_atomic_load(&ring->head);
+
+        if (pos + n - head > ring->mask + 1) {
+            //ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+            //              "thread pool \"%V\" queue overflow", &tp->name);
+            return NGX_ERROR;
+        }
+
+        if (ngx_atomic_cmp_set(&ring->tail, pos, pos + n)) {
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++, pos++) {
+        cell = &ring->cells[pos & ring->mask];
+
+        while (ngx_atomic_load(&cell->seq) != pos) {
+            ngx_cpu_pause();
+        }
+
+        next = task->next;
+        task->next = NULL;
+
+        cell->task = task;
+        ngx_atomic_store(&cell->seq, pos + 1);
+
+        task = next;
+    }
+
+    ngx_thread_pool_wake(tp, n);
+
+    return NGX_OK;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_ring_get(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker)
+{
+    ngx_int_t           rc;
+    ngx_thread_task_t  *task;
+
+    task = ngx_thread_pool_ring_pop(&tp->ring);
+    if (task) {
+        return task;
+    }
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NULL;
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->idle, 1);
+
+    rc = NGX_OK;
+
+    for ( ;; ) {
+        task = ngx_thread_pool_ring_pop(&tp->ring);
+        if (task || tp->exiting) {
+            break;
+        }
+
+        if (rc == NGX_AGAIN && ngx_thread_pool_retire(tp, worker)) {
+            break;
+        }
+
+        rc = ngx_thread_pool_park(tp);
+
+        if (rc == NGX_ERROR) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->idle, -1);
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    return task;
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_ring_depth(ngx_thread_pool_t *tp)
+{
+    ngx_atomic_int_t  n;
+
+    n = tp->ring.tail - tp->ring.head;
+
+    return (n > 0) ? n : 0;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_ring_push(ngx_thread_pool_ring_t *ring,
+    ngx_thread_task_t *task)
+{
+    ngx_int_t                diff;
+    ngx_atomic_uint_t        pos, seq;
+    ngx_thread_pool_cell_t  *cell;
+
+    pos = ring->tail;
+
+    for ( ;; ) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = ngx_atomic_load(&cell->seq);
+        diff = (ngx_int_t) seq - (ngx_int_t) pos;
+
+        if (diff == 0) {
+            if (ngx_atomic_cmp_set(&ring->tail, pos, pos + 1)) {
+                break;
+            }
+
+        } else if (diff < 0) {
+            return NGX_AGAIN;
+        }
+
+        pos = ring->tail;
+    }
+
+    cell->task = task;
+    ngx_atomic_store(&cell->seq, pos + 1);
+
+    return NGX_OK;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_ring_pop(ngx_thread_pool_ring_t *ring)
+{
+    ngx_int_t                diff;
+    ngx_atomic_uint_t        pos, seq;
+    ngx_thread_task_t       *task;
+    ngx_thread_pool_cell_t  *cell;
+
+    pos = ring->head;
+
+    for ( ;; ) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = ngx_atomic_load(&cell->seq);
+        diff = (ngx_int_t) seq - (ngx_int_t) (pos + 1);
+
+        if (diff == 0) {
+            if (ngx_atomic_cmp_set(&ring->head, pos, pos + 1)) {
+                break;
+            }
+
+        } else if (diff < 0) {
+            return NULL;
+        }
+
+        pos = ring->head;
+    }
+
+    task = cell->task;
+    ngx_atomic_store(&cell->seq, pos + ring->mask + 1);
+
+    return task;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_steal_init(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t                 i, n;
+    ngx_thread_pool_worker_t  *worker;
+
+    /*
+     * single posts fill each inbox up to its share of max_queue, batches
+     * may fill an inbox up to the deque size, so it always fits into the
+     * deque when the owner moves it there
+     */
+
+    tp->share = tp->max_queue / tp->threads;
+
+    if (tp->share == 0) {
+        tp->share = 1;
+    }
+
+    for (n = 2; n < (ngx_uint_t) tp->max_queue; n <<= 1) { /* void */ }
+
+    for (i = 0; i < tp->threads; i++) {
+        worker = &tp->workers[i];
+
+        worker->deque.buf = malloc(n * sizeof(ngx_thread_task_t *));
+        if (worker->deque.buf == NULL) {
+            LOG_ERROR("malloc(%lu) failed", n * sizeof(ngx_thread_task_t *));
+            ngx_thread_pool_steal_done(tp);
+            return NGX_ERROR;
+        }
+
+        worker->deque.mask = n - 1;
+        worker->deque.top = 0;
+        worker->deque.bottom = 0;
+
+        worker->lock = 0;
+        ngx_thread_pool_queue_init(&worker->inbox);
+        worker->ninbox = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_pool_steal_done(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < tp->threads; i++) {
+        free(tp->workers[i].deque.buf);
+        tp->workers[i].deque.buf = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_thread_pool_steal_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    int                        node;
+    ngx_uint_t                 i, n;
+    ngx_thread_pool_worker_t  *worker;
+
+    task->id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, 1);
+    task->next = NULL;
+
+    /*
+     * every producer thread walks the inboxes round robin from its own
+     * position, so producers do not share a cache line to pick a worker
+     */
+
+    if (ngx_thread_pool_rr == 0) {
+        ngx_thread_pool_rr = ngx_thread_tid();
+    }
+
+    node = tp->route ? ngx_current_node() : -1;
+    n = (node == -1) ? tp->threads : 2 * tp->threads;
+
+    for (i = 0; i < n; i++) {
+        worker = ngx_thread_pool_steal_inbox(tp, i, node);
+        if (worker == NULL) {
+            continue;
+        }
+
+        ngx_spinlock(&worker->lock, 1, 2048);
+
+        if (worker->ninbox < tp->share) {
+            *worker->inbox.last = task;
+            worker->inbox.last = &task->next;
+            worker->ninbox++;
+
+            ngx_unlock(&worker->lock);
+
+            goto posted;
+        }
+
+        ngx_unlock(&worker->lock);
+    }
+
+    //ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+    //              "thread pool \"%V\" queue overflow", &tp->name);
+    return NGX_ERROR;
+
+posted:
+
+    ngx_thread_pool_wake(tp, 1);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_steal_post_chain(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_uint_t n)
+{
+    int                        node;
+    ngx_uint_t                 i, tries;
+    ngx_thread_task_t         *last;
+    ngx_thread_pool_worker_t  *worker;
+
+    for (last = task; last->next; last = last->next) { /* void */ }
+
+    ngx_thread_pool_chain_ids(task, n);
+
+    /* the whole batch goes to one inbox, idle workers steal from it */
+
+    if (ngx_thread_pool_rr == 0) {
+        ngx_thread_pool_rr = ngx_thread_tid();
+    }
+
+    node = tp->route ? ngx_current_node() : -1;
+    tries = (node == -1) ? tp->threads : 2 * tp->threads;
+
+    for (i = 0; i < tries; i++) {
+        worker = ngx_thread_pool_steal_inbox(tp, i, node);
+        if (worker == NULL) {
+            continue;
+        }
+
+        ngx_spinlock(&worker->lock, 1, 2048);
+
+        if (worker->ninbox + n <= worker->deque.mask + 1) {
+            *worker->inbox.last = task;
+            worker->inbox.last = &last->next;
+            worker->ninbox += n;
+
+            ngx_unlock(&worker->lock);
+
+            ngx_thread_pool_wake(tp, n);
+
+            return NGX_OK;
+        }
+
+        ngx_unlock(&worker->lock);
+    }
+
+    //ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+    //              "thread pool \"%V\" queue overflow", &tp->name);
+    return NGX_ERROR;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_steal_get(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker)
+{
+    ngx_int_t           rc;
+    ngx_thread_task_t  *task, *next, *prev;
+
+    rc = NGX_OK;
+
+    for ( ;; ) {
+        task = ngx_thread_pool_deque_take(&worker->deque);
+        if (task) {
+            return task;
+        }
+
+        if (worker->inbox.first) {
+            ngx_spinlock(&worker->lock, 1, 2048);
+
+            task = worker->inbox.first;
+            ngx_thread_pool_queue_init(&worker->inbox);
+            worker->ninbox = 0;
+
+            ngx_unlock(&worker->lock);
+
+            if (task) {
+
+                /*
+                 * push the rest of the inbox newest first, so the owner
+                 * pops it in posting order and thieves take the newest
+                 */
+
+                prev = NULL;
+
+                for (next = task->next; next; next = task->next) {
+                    task->next = prev;
+                    prev = task;
+                    task = next;
+                }
+
+                task->next = prev;
+
+                for (next = task->next; next; next = next->next) {
+                    (void) ngx_thread_pool_deque_push(&worker->deque,
+                                                       task);
+                    task = next;
+                }
+
+                task->next = NULL;
+
+                return task;
+            }
+        }
+
+        task = ngx_thread_pool_steal(tp, worker);
+        if (task) {
+            return task;
+        }
+
+        if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+            return NULL;
+        }
+
+        (void) ngx_atomic_fetch_add(&tp->idle, 1);
+
+        if (!ngx_thread_pool_steal_ready(tp)) {
+
+            if (tp->exiting
+                || (rc == NGX_AGAIN && ngx_thread_pool_retire(tp, worker)))
+            {
+                rc = NGX_ERROR;
+
+            } else {
+                rc = ngx_thread_pool_park(tp);
+            }
+
+            if (rc == NGX_ERROR) {
+                (void) ngx_atomic_fetch_add(&tp->idle, -1);
+                (void) ngx_thread_mutex_unlock(&tp->mtx);
+                return NULL;
+            }
+
+        } else {
+            rc = NGX_OK;
+        }
+
+        (void) ngx_atomic_fetch_add(&tp->idle, -1);
+
+        if (ngx_thread_mutex_unlock(&tp->mtx) != NGX_OK) {
+            return NULL;
+        }
+    }
+}
+
+
+/*
+ * the i-th inbox to try when posting from a thread on the node: the first
+ * round only offers workers of the node, the second one all workers
+ */
+
+static ngx_thread_pool_worker_t *
+ngx_thread_pool_steal_inbox(ngx_thread_pool_t *tp, ngx_uint_t i, int node)
+{
+    ngx_thread_pool_worker_t  *worker;
+
+    worker = &tp->workers[ngx_thread_pool_rr++ % tp->threads];
+
+    if (i < tp->threads && node != -1 && worker->node != node) {
+        return NULL;
+    }
+
+    return worker;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_steal(ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker)
+{
+    ngx_uint_t                 i, n, tries;
+    ngx_thread_task_t         *task;
+    ngx_thread_pool_worker_t  *victim;
+
+    /* xorshift */
+
+    worker->rand ^= worker->rand << 13;
+    worker->rand ^= worker->rand >> 7;
+    worker->rand ^= worker->rand << 17;
+
+    n = worker->rand % tp->threads;
+
+    /* with node routing, victims on the own node are tried first */
+
+    tries = tp->route ? 2 * tp->threads : tp->threads;
+
+    for (i = 0; i < tries; i++, n++) {
+        victim = &tp->workers[n % tp->threads];
+
+        if (victim == worker
+            || (i < tp->threads && tp->route && victim->node != worker->node))
+        {
+            continue;
+        }
+
+        task = ngx_thread_pool_deque_steal(&victim->deque);
+        if (task) {
+            return task;
+        }
+
+        if (victim->inbox.first == NULL || !ngx_trylock(&victim->lock)) {
+            continue;
+        }
+
+        task = victim->inbox.first;
+
+        if (task) {
+            victim->inbox.first = task->next;
+
+            if (victim->inbox.first == NULL) {
+                victim->inbox.last = &victim->inbox.first;
+            }
+
+            victim->ninbox--;
+        }
+
+        ngx_unlock(&victim->lock);
+
+        if (task) {
+            task->next = NULL;
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_steal_ready(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t                 i;
+    ngx_thread_pool_worker_t  *worker;
+
+    for (i = 0; i < tp->threads; i++) {
+        worker = &tp->workers[i];
+
+        if (worker->inbox.first
+            || (ngx_atomic_int_t) (worker->deque.bottom - worker->deque.top)
+               > 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_uint_t
+ngx_thread_pool_steal_depth(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t                 i, n;
+    ngx_atomic_int_t           d;
+    ngx_thread_pool_worker_t  *worker;
+
+    n = 0;
+
+    for (i = 0; i < tp->threads; i++) {
+        worker = &tp->workers[i];
+
+        d = worker->deque.bottom - worker->deque.top;
+
+        n += worker->ninbox + ((d > 0) ? d : 0);
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_deque_push(ngx_thread_pool_deque_t *deque,
+    ngx_thread_task_t *task)
+{
+    ngx_atomic_uint_t  b, t;
+
+    b = deque->bottom;
+    t = ngx_atomic_load(&deque->top);
+
+    if (b - t > deque->mask) {
+        return NGX_AGAIN;
+    }
+
+    deque->buf[b & deque->mask] = task;
+    ngx_atomic_store(&deque->bottom, b + 1);
+
+    return NGX_OK;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_deque_take(ngx_thread_pool_deque_t *deque)
+{
+    ngx_atomic_uint_t   b, t;
+    ngx_thread_task_t  *task;
+
+    b = deque->bottom - 1;
+    deque->bottom = b;
+
+    ngx_memory_barrier();
+
+    t = deque->top;
+
+    if ((ngx_atomic_int_t) (b - t) < 0) {
+        deque->bottom = b + 1;
+        return NULL;
+    }
+
+    task = deque->buf[b & deque->mask];
+
+    if (b != t) {
+        return task;
+    }
+
+    /* the last task, race against thieves */
+
+    if (!ngx_atomic_cmp_set(&deque->top, t, t + 1)) {
+        task = NULL;
+    }
+
+    deque->bottom = b + 1;
+
+    return task;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_deque_steal(ngx_thread_pool_deque_t *deque)
+{
+    ngx_atomic_uint_t   b, t;
+    ngx_thread_task_t  *task;
+
+    t = ngx_atomic_load(&deque->top);
+
+    ngx_memory_barrier();
+
+    b = ngx_atomic_load(&deque->bottom);
+
+    if ((ngx_atomic_int_t) (b - t) <= 0) {
+        return NULL;
+    }
+
+    task = deque->buf[t & deque->mask];
+
+    if (!ngx_atomic_cmp_set(&deque->top, t, t + 1)) {
+        return NULL;
+    }
+
+    return task;
+}
+
+
+static void *
+ngx_thread_pool_cycle(void *data)
+{
+    ngx_thread_pool_worker_t *worker = data;
+
+    int                 err;
+    sigset_t            set;
+    ngx_uint_t          queued;
+    ngx_thread_task_t  *task, *next;
+    ngx_thread_pool_t  *tp;
+
+    tp = worker->tp;
+
+    ngx_thread_pool_current = worker;
+
+    worker->lwp = ngx_thread_tid();
+
+#if 0
+    ngx_time_update();
+#endif
+
+    //ngx_log_debug1(NGX_LOG_DEBUG_CORE, tp->log, 0,
+    //               "thread in pool \"%V\" started", &tp->name);
+
+    sigfillset(&set);
+
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+
+    err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err) {
+        //ngx_log_error(NGX_LOG_ALERT, tp->log, err, "pthread_sigmask() failed");
+        LOG_ERROR("pthread_sigmask() failed");
+        goto exit;
+    }
+
+    next = NULL;
+
+    for ( ;; ) {
+
+        /* a successor released by the previous task runs on this worker */
+
+        if (next) {
+            task = next;
+            queued = 0;
+
+        } else if (tp->woken) {
+            task = ngx_thread_pool_woken(tp);
+            if (task == NULL) {
+                continue;
+            }
+
+            queued = 1;
+
+        } else if (worker->lifo) {
+            task = worker->lifo;
+            worker->lifo = NULL;
+            queued = 1;
+
+            /*
+             * a chain of tasks posting each other goes through the queue
+             * now and then, so the tasks waiting there are not starved
+             */
+
+            if (++worker->lifo_runs > NGX_THREAD_POOL_LIFO_RUNS
+                && tp->engine->post(tp, task) == NGX_OK)
+            {
+                worker->lifo_runs = 0;
+                continue;
+            }
+
+        } else {
+            worker->lifo_runs = 0;
+
+            task = tp->engine->get(tp, worker);
+
+            if (task == NULL) {
+
+                /* suspended fibers hold tasks that have started */
+
+                if (tp->exiting && tp->suspended) {
+                    ngx_thread_fiber_linger(tp);
+                    continue;
+                }
+
+                break;
+            }
+
+#if (NGX_HAVE_FUTEX)
+            ngx_thread_pool_space(tp);
+#endif
+            queued = 1;
+        }
+
+        if (task->state == NGX_THREAD_TASK_STRAND) {
+            ngx_thread_pool_strand(tp, worker,
+                                   (ngx_thread_strand_t *) task->ctx);
+            next = NULL;
+            continue;
+        }
+
+        if (task->state == NGX_THREAD_TASK_FIBER) {
+            next = ngx_thread_fiber_resume(tp, worker,
+                                           (ngx_thread_fiber_t *) task->ctx);
+            continue;
+        }
+
+        if (tp->exiting == NGX_THREAD_POOL_ABORT) {
+            next = ngx_thread_pool_drop(tp, task);
+            continue;
+        }
+
+        if (tp->fibers) {
+            next = ngx_thread_fiber_run(tp, worker, task, queued);
+            continue;
+        }
+
+        next = ngx_thread_pool_run(tp, worker, task, queued);
+    }
+
+exit:
+
+    /* a retired worker's slot may be taken by a new worker */
+
+    if (worker->spare) {
+        ngx_spinlock(&tp->fiber_lock, 1, 2048);
+
+        worker->spare->free = tp->fiber_free;
+        tp->fiber_free = worker->spare;
+
+        ngx_unlock(&tp->fiber_lock);
+
+        worker->spare = NULL;
+    }
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return NULL;
+    }
+
+    /* retired workers have already left the count */
+
+    if (worker->state == NGX_THREAD_POOL_WORKER_RUNNING) {
+        worker->state = NGX_THREAD_POOL_WORKER_LEAVING;
+        tp->nthreads--;
+    }
+
+    if (tp->nthreads == 0) {
+        (void) ngx_thread_cond_signal(&tp->exit_cond);
+    }
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    /*
+     * the manager may join the thread under tp->mtx as soon as it sees
+     * the slot exited, so this is the last access to the pool
+     */
+
+    ngx_atomic_store(&worker->state, NGX_THREAD_POOL_WORKER_EXITED);
+
+    return NULL;
+}
+
+
+/*
+ * runs a task taken off the queue, or a successor run in place if queued
+ * is 0, and returns the successor it has released to this worker
+ */
+
+static ngx_thread_task_t *
+ngx_thread_pool_run(ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker,
+    ngx_thread_task_t *task, ngx_uint_t queued)
+{
+    ngx_thread_pool_event_t     ev;
+    ngx_thread_worker_stats_t  *stats;
+
+    stats = &worker->stats;
+
+    if (!queued) {
+        task->id = ngx_atomic_fetch_add(&ngx_thread_pool_task_id, 1);
+    }
+
+    if (tp->trace) {
+        ev.dequeued = ngx_monotonic_usec();
+        ev.start = 0;
+    }
+
+#if 0
+    ngx_time_update();
+#endif
+
+    //ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+    //               "run task #%ui in thread pool \"%V\"",
+    //               task->id, &tp->name);
+
+    if (!ngx_atomic_cmp_set(&task->state, NGX_THREAD_TASK_QUEUED,
+                            NGX_THREAD_TASK_STARTED))
+    {
+        if (task->state == NGX_THREAD_TASK_STARTED) {
+
+            /* claimed and done by the handler of another task */
+
+            stats->completed++;
+
+        } else {
+            task->status = NGX_THREAD_TASK_CANCELLED;
+            stats->skipped++;
+        }
+
+    } else if (task->deadline
+               && (ngx_msec_int_t) (ngx_monotonic_msec() - task->deadline)
+                  >= 0)
+    {
+        task->status = NGX_THREAD_TASK_EXPIRED;
+        stats->skipped++;
+
+    } else if (ngx_thread_pool_timed(tp)) {
+        ev.start = ngx_monotonic_usec();
+
+        worker = ngx_thread_pool_handler(tp, worker, task);
+        stats = &worker->stats;
+
+        ev.end = ngx_monotonic_usec();
+
+        stats->completed++;
+
+        /* a successor run in place has not waited in the queue */
+
+        if (tp->latency) {
+            if (queued) {
+                stats->wait[ngx_thread_pool_bucket(ev.start
+                                                   - task->queued)]++;
+            }
+
+            stats->run[ngx_thread_pool_bucket(ev.end - ev.start)]++;
+            stats->busy += ev.end - ev.start;
+        }
+
+    } else {
+        worker = ngx_thread_pool_handler(tp, worker, task);
+        stats = &worker->stats;
+
+        stats->completed++;
+    }
+
+    if (tp->trace) {
+        ev.id = task->id;
+        ev.status = task->status;
+        ev.tid = worker->lwp;
+        ev.posted = queued ? task->queued : 0;
+
+        if (ev.start == 0) {
+            ev.end = ev.dequeued;
+        }
+
+        ngx_thread_pool_trace(&tp->traces[worker->index], &ev);
+    }
+
+    //ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+    //               "complete task #%ui in thread pool \"%V\"",
+    //               task->id, &tp->name);
+
+    return ngx_thread_pool_finish(tp, task);
+}
+
+
+/*
+ * runs a batch of the tasks of a strand the worker has taken off the queue,
+ * then puts the strand back at the tail of the queue if it has more
+ */
+
+static void
+ngx_thread_pool_strand(ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker,
+    ngx_thread_strand_t *strand)
+{
+    ngx_uint_t          n, queued;
+    ngx_thread_task_t  *task;
+
+    for ( ;; ) {
+
+        for (n = 0; n < NGX_THREAD_STRAND_BATCH; n++) {
+            ngx_spinlock(&strand->lock, 1, 2048);
+
+            task = strand->first;
+
+            if (task == NULL) {
+                strand->busy = 0;
+                ngx_unlock(&strand->lock);
+                return;
+            }
+
+            strand->first = task->next;
+
+            if (strand->first == NULL) {
+                strand->last = &strand->first;
+            }
+
+            ngx_unlock(&strand->lock);
+
+            task->next = NULL;
+
+            /* successors of a strand task are not part of the strand */
+
+            for (queued = 1; task; queued = 0) {
+                if (tp->exiting == NGX_THREAD_POOL_ABORT) {
+                    task = ngx_thread_pool_drop(tp, task);
+
+                } else {
+                    task = ngx_thread_pool_run(tp, worker, task, queued);
+                }
+            }
+        }
+
+        if (tp->engine->post(tp, &strand->task) == NGX_OK) {
+            return;
+        }
+
+        /* the queue is full, carry on with the next batch */
+    }
+}
+
+
+static ngx_thread_pool_worker_t *
+ngx_thread_pool_handler(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker, ngx_thread_task_t *task)
+{
+    task->handler(task->ctx);
+
+    /* a handler that has waited on a fiber may return on another worker */
+
+    return tp->fibers ? ngx_thread_pool_self() : worker;
+}
+
+
+/*
+ * not inlined, so that the thread local variable is looked up on the
+ * thread that runs a fiber now, not on the one that started it
+ */
+
+static ngx_thread_pool_worker_t *
+ngx_thread_pool_self(void)
+{
+    return ngx_thread_pool_current;
+}
+
+
+/*
+ * runs a task on a fiber, or on the worker's stack if the pool has no
+ * fiber to spare, and returns the successor it has released
+ */
+
+static ngx_thread_task_t *
+ngx_thread_fiber_run(ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker,
+    ngx_thread_task_t *task, ngx_uint_t queued)
+{
+    ngx_thread_fiber_t  *fiber;
+
+    fiber = ngx_thread_fiber_get(tp, worker);
+
+    if (fiber == NULL) {
+        return ngx_thread_pool_run(tp, worker, task, queued);
+    }
+
+    fiber->run = task;
+    fiber->queued = queued;
+
+    return ngx_thread_fiber_resume(tp, worker, fiber);
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_fiber_resume(ngx_thread_pool_t *tp,
+    ngx_thread_pool_worker_t *worker, ngx_thread_fiber_t *fiber)
+{
+    ngx_thread_task_t  *next;
+
+    if (fiber->state == NGX_THREAD_FIBER_WAITING
+        && ngx_atomic_fetch_add(&tp->suspended, -1) == 1
+        && tp->exiting)
+    {
+        ngx_thread_pool_wake(tp, tp->threads);
+    }
+
+    fiber->state = NGX_THREAD_FIBER_RUNNING;
+    fiber->worker = worker;
+    worker->fiber = fiber;
+
+    ngx_thread_context_switch(&worker->ctx, &fiber->ctx);
+
+    worker->fiber = NULL;
+
+    if (fiber->state == NGX_THREAD_FIBER_WAITING) {
+
+        /* the fiber is off its stack now, so it may be resumed anywhere */
+
+        ngx_thread_fiber_park(tp, fiber);
+
+        return NULL;
+    }
+
+    next = fiber->next;
+    fiber->next = NULL;
+
+    ngx_thread_fiber_put(tp, worker, fiber);
+
+    return next;
+}
+
+
+static void
+ngx_thread_fiber_start(void)
+{
+    ngx_thread_fiber_t        *fiber;
+    ngx_thread_pool_worker_t  *worker;
+
+    for ( ;; ) {
+        worker = ngx_thread_pool_self();
+        fiber = worker->fiber;
+
+        fiber->next = ngx_thread_pool_run(worker->tp, worker, fiber->run,
+                                          fiber->queued);
+        fiber->run = NULL;
+        fiber->state = NGX_THREAD_FIBER_DONE;
+
+        /* the task may have been resumed on another worker */
+
+        ngx_thread_context_switch(&fiber->ctx, &fiber->worker->ctx);
+    }
+}
+
+
+/* switches back to the worker, which parks the fiber on the future */
+
+static void
+ngx_thread_fiber_suspend(ngx_thread_fiber_t *fiber,
+    ngx_thread_future_t *future)
+{
+    (void) ngx_atomic_fetch_add(&fiber->worker->tp->suspended, 1);
+
+    fiber->wait = future;
+    fiber->state = NGX_THREAD_FIBER_WAITING;
+
+    ngx_thread_context_switch(&fiber->ctx, &fiber->worker->ctx);
+
+    /* resumed, maybe on another worker */
+
+    fiber->wait = NULL;
+}
+
+
+static void
+ngx_thread_fiber_park(ngx_thread_pool_t *tp, ngx_thread_fiber_t *fiber)
+{
+#if (NGX_HAVE_FUTEX)
+    ngx_thread_future_t  *future;
+
+    future = fiber->wait;
+
+    if (future) {
+        ngx_spinlock(&future->lock, 1, 2048);
+
+        if (future->pending) {
+            fiber->task.next = future->then;
+            future->then = &fiber->task;
+
+            ngx_unlock(&future->lock);
+            return;
+        }
+
+        ngx_unlock(&future->lock);
+    }
+#endif
+
+    ngx_thread_fiber_wake(tp, fiber);
+}
+
+
+static void
+ngx_thread_fiber_wake(ngx_thread_pool_t *tp, ngx_thread_fiber_t *fiber)
+{
+    ngx_thread_task_t  *task;
+
+    task = &fiber->task;
+
+#if (NGX_HAVE_FUTEX)
+
+    /*
+     * a future's completion may wake the fiber outside the pool, then the
+     * fiber may run and the pool shut down as soon as it is posted, so the
+     * shutdown waits for wakers still touching the queue; the pool itself
+     * outlives the shutdown
+     */
+
+    (void) ngx_atomic_fetch_add(&tp->waking, 1);
+
+    ngx_thread_pool_requeue(tp, task);
+
+    if (ngx_atomic_fetch_add(&tp->waking, -1) == 1 && tp->exiting) {
+        ngx_futex_wake(&tp->waking, 1);
+    }
+
+#else
+
+    ngx_thread_pool_requeue(tp, task);
+
+#endif
+}
+
+
+/*
+ * an exiting pool's workers stay while fibers are suspended, since those
+ * hold tasks that have started: they park like idle workers until a fiber
+ * is woken or none is suspended any longer
+ */
+
+static void
+ngx_thread_fiber_linger(ngx_thread_pool_t *tp)
+{
+#if (NGX_HAVE_FUTEX)
+    uint32_t  seq;
+
+    if (tp->futex_park) {
+        seq = ngx_atomic_load(&tp->futex);
+
+        (void) ngx_atomic_fetch_add(&tp->parked, 1);
+
+        if (tp->suspended && tp->woken == NULL && !tp->engine->ready(tp)) {
+            (void) ngx_futex_wait(&tp->futex, seq, 0);
+        }
+
+        (void) ngx_atomic_fetch_add(&tp->parked, -1);
+
+        return;
+    }
+#endif
+
+    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->idle, 1);
+
+    while (tp->suspended && tp->woken == NULL && !tp->engine->ready(tp)) {
+        if (ngx_thread_cond_wait(&tp->cond, &tp->mtx) != NGX_OK) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->idle, -1);
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+}
+
+
+static ngx_thread_fiber_t *
+ngx_thread_fiber_get(ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker)
+{
+    u_char              *stack;
+    size_t               page;
+    ngx_thread_fiber_t  *fiber;
+
+    fiber = worker->spare;
+
+    if (fiber) {
+        worker->spare = NULL;
+        return fiber;
+    }
+
+    ngx_spinlock(&tp->fiber_lock, 1, 2048);
+
+    fiber = tp->fiber_free;
+
+    if (fiber) {
+        tp->fiber_free = fiber->free;
+        ngx_unlock(&tp->fiber_lock);
+        return fiber;
+    }
+
+    if (tp->nfibers == tp->fibers) {
+        ngx_unlock(&tp->fiber_lock);
+        return NULL;
+    }
+
+    tp->nfibers++;
+
+    ngx_unlock(&tp->fiber_lock);
+
+    fiber = calloc(1, sizeof(ngx_thread_fiber_t));
+    if (fiber == NULL) {
+        LOG_ERROR("calloc() failed");
+        goto failed;
+    }
+
+    /* the lowest page of the stack is a guard */
+
+    stack = mmap(NULL, tp->fiber_stack, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+
+    if (stack == MAP_FAILED) {
+        LOG_ERROR("mmap(%lu) of fiber stack failed, errno %d",
+                  tp->fiber_stack, errno);
+        free(fiber);
+        goto failed;
+    }
+
+    page = sysconf(_SC_PAGESIZE);
+
+    (void) mprotect(stack, page, PROT_NONE);
+
+    fiber->stack = stack;
+
+    fiber->task.state = NGX_THREAD_TASK_FIBER;
+    fiber->task.ctx = fiber;
+    fiber->task.pool = tp;
+
+    ngx_thread_context_init(&fiber->ctx, stack + page,
+                            tp->fiber_stack - page, ngx_thread_fiber_start);
+
+    ngx_spinlock(&tp->fiber_lock, 1, 2048);
+
+    fiber->all = tp->fiber_all;
+    tp->fiber_all = fiber;
+
+    ngx_unlock(&tp->fiber_lock);
+
+    return fiber;
+
+failed:
+
+    ngx_spinlock(&tp->fiber_lock, 1, 2048);
+    tp->nfibers--;
+    ngx_unlock(&tp->fiber_lock);
+
+    return NULL;
+}
+
+
+static void
+ngx_thread_fiber_put(ngx_thread_pool_t *tp, ngx_thread_pool_worker_t *worker,
+    ngx_thread_fiber_t *fiber)
+{
+    if (worker->spare == NULL) {
+        worker->spare = fiber;
+        return;
+    }
+
+    ngx_spinlock(&tp->fiber_lock, 1, 2048);
+
+    fiber->free = tp->fiber_free;
+    tp->fiber_free = fiber;
+
+    ngx_unlock(&tp->fiber_lock);
+}
+
+
+/* called once all workers have exited, no fiber is suspended then */
+
+static void
+ngx_thread_fiber_free(ngx_thread_pool_t *tp)
+{
+    ngx_thread_fiber_t  *fiber, *next;
+
+    for (fiber = tp->fiber_all; fiber; fiber = next) {
+        next = fiber->all;
+
+        (void) munmap(fiber->stack, tp->fiber_stack);
+        free(fiber);
+    }
+
+    tp->fiber_all = NULL;
+    tp->fiber_free = NULL;
+    tp->nfibers = 0;
+    tp->woken = NULL;
+}
+
+
+/*
+ * reports a task that has run or was skipped, and returns its successor
+ * if the task was the last predecessor and the successor is to run on
+ * this worker
+ */
+
+static ngx_thread_task_t *
+ngx_thread_pool_finish(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_uint_t            status;
+    ngx_thread_task_t    *next;
+    ngx_thread_pool_t    *pool;
+#if (NGX_HAVE_FUTEX)
+    ngx_thread_future_t  *future;
+#endif
+
+    status = task->status;
+
+    /* a periodic task is reported once it stops */
+
+    if (task->period) {
+        if (status == NGX_THREAD_TASK_DONE && ngx_thread_pool_rearm(tp, task))
+        {
+            return NULL;
+        }
+
+        task->period = 0;
+    }
+
+    next = task->successor;
+    task->successor = NULL;
+
+#if (NGX_HAVE_FUTEX)
+    if (task->future) {
+        future = task->future;
+        task->future = NULL;
+
+        ngx_thread_future_complete(future, status);
+    }
+#endif
+
+    task->next = NULL;
+
+    /* the task may be freed from here on */
+
+    if (task->complete) {
+        ngx_thread_pool_done(task->pool ? task->pool : tp, task);
+
+    } else if (task->slab) {
+        ngx_thread_task_free(task);
+    }
+
+    if (next == NULL) {
+        return NULL;
+    }
+
+    /* a successor does not run without the result of its predecessor */
+
+    if (status != NGX_THREAD_TASK_DONE) {
+        (void) ngx_atomic_cmp_set(&next->state, NGX_THREAD_TASK_QUEUED,
+                                  NGX_THREAD_TASK_WITHDRAWN);
+    }
+
+    if (ngx_atomic_fetch_add(&next->deps, -1) != 1) {
+        return NULL;
+    }
+
+    pool = next->pool;
+
+    if (pool == tp) {
+        return next;
+    }
+
+    if (ngx_thread_pool_timed(pool)) {
+        next->queued = ngx_monotonic_usec();
+    }
+
+    if (pool->engine->post(pool, next) == NGX_OK) {
+        return NULL;
+    }
+
+    LOG_ERROR("thread pool \"%s\" queue overflow, successor task cancelled",
+              pool->name);
+
+    /* skipped here, which reports it to its own pool */
+
+    (void) ngx_atomic_cmp_set(&next->state, NGX_THREAD_TASK_QUEUED,
+                              NGX_THREAD_TASK_WITHDRAWN);
+
+    return next;
+}
+
+
+/*
+ * on abort a task taken off the queue is not run but returned by
+ * ngx_thread_pool_shutdown(), and so is a successor it was the last
+ * predecessor of
+ */
+
+static ngx_thread_task_t *
+ngx_thread_pool_drop(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_thread_task_t    *next;
+#if (NGX_HAVE_FUTEX)
+    ngx_thread_future_t  *future;
+#endif
+
+    next = task->successor;
+    task->successor = NULL;
+
+    task->next = NULL;
+    task->status = NGX_THREAD_TASK_CANCELLED;
+
+#if (NGX_HAVE_FUTEX)
+    if (task->future) {
+        future = task->future;
+        task->future = NULL;
+
+        ngx_thread_future_complete(future, task->status);
+    }
+#endif
+
+    (void) ngx_thread_mutex_lock(&tp->mtx);
+
+    *tp->dropped.last = task;
+    tp->dropped.last = &task->next;
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx);
+
+    if (next == NULL) {
+        return NULL;
+    }
+
+    (void) ngx_atomic_cmp_set(&next->state, NGX_THREAD_TASK_QUEUED,
+                              NGX_THREAD_TASK_WITHDRAWN);
+
+    if (ngx_atomic_fetch_add(&next->deps, -1) != 1) {
+        return NULL;
+    }
+
+    return next;
+}
+
+
+static void
+ngx_thread_pool_done(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+#if (NGX_HAVE_EVENTFD)
+    uint64_t            value;
+#endif
+    ngx_thread_task_t  *first;
+
+    /*
+     * the done queue is a lock-free stack: workers push completed tasks,
+     * the event loop takes the whole stack in one exchange
+     */
+
+    do {
+        first = tp->done;
+        task->next = first;
+    } while (!ngx_atomic_cmp_set(&tp->done, first, task));
+
+    if (first) {
+        /* the event loop is already notified */
+        return;
+    }
+
+#if (NGX_HAVE_EVENTFD)
+
+    value = 1;
+
+    if (write(tp->notify, &value, sizeof(uint64_t)) != sizeof(uint64_t)
+        && errno != EAGAIN)
+    {
+        LOG_ERROR("write() to eventfd %d failed, errno %d", tp->notify, errno);
+    }
+
+#endif
+}
+
+
+int
+ngx_thread_pool_notify_fd(ngx_thread_pool_t *tp)
+{
+    return tp->notify;
+}
+
+
+ngx_int_t
+ngx_thread_pool_process_completions(ngx_thread_pool_t *tp)
+{
+#if (NGX_HAVE_EVENTFD)
+    uint64_t            value;
+#endif
+    ngx_int_t           n;
+    ngx_thread_task_t  *task, *next, *prev;
+
+    //ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
+
+#if (NGX_HAVE_EVENTFD)
+
+    /* reset the eventfd before taking the stack, so no notify is lost */
+
+    (void) read(tp->notify, &value, sizeof(uint64_t));
+
+#endif
+
+    task = ngx_atomic_swap(&tp->done, NULL);
+
+    /* restore completion order */
+
+    prev = NULL;
+
+    while (task) {
+        next = task->next;
+        task->next = prev;
+        prev = task;
+        task = next;
+    }
+
+    n = 0;
+
+    for (task = prev; task; task = next) {
+        //ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+        //               "run completion handler for task #%ui", task->id);
+
+        next = task->next;
+        task->next = NULL;
+
+        task->complete(task);
+
+        if (task->slab) {
+            ngx_thread_task_free(task);
+        }
+
+        n++;
+    }
+
+    if (tp->poll) {
+        n += tp->poll(tp->poll_data);
+    }
+
+    return n;
+}
+
+
+void
+ngx_thread_pool_set_poll(ngx_thread_pool_t *tp,
+    ngx_thread_pool_poll_pt handler, void *data)
+{
+    tp->poll = handler;
+    tp->poll_data = data;
+}
+
+
+//config me
+ngx_thread_pool_t* 
+ngx_thread_pool_config(ngx_uint_t threads)
+{
+    ngx_int_t max_queue = 65536;
+    if (threads < 1) {
+        threads = 1;
+    }
+    
+    ngx_thread_pool_t* tp = ngx_thread_pool_add("default");
+    
+    if (tp == NULL || tp->threads) {
+        return tp;
+    }
+    
+    tp->threads = threads;
+    tp->max_queue = max_queue;
+    
+    return tp;
+}
+
+
+ngx_thread_pool_t *
+ngx_thread_pool_add(const char *name)
+{
+    ngx_uint_t                i;
+    ngx_thread_pool_t       **elts;
+    ngx_thread_pool_t        *tp;
+    ngx_thread_pool_conf_t   *tcf;
+
+    tp = ngx_thread_pool_get(name);
+
+    if (tp) {
+        return tp;
+    }
+
+    tcf = &ngx_thread_pool_conf;
+
+    if (tcf->nelts == tcf->nalloc) {
+        tcf->nalloc = tcf->nalloc ? 2 * tcf->nalloc : 4;
+
+        elts = realloc(tcf->elts, tcf->nalloc * sizeof(ngx_thread_pool_t *));
+        if (elts == NULL) {
+            LOG_ERROR("realloc() failed");
+            return NULL;
+        }
+
+        tcf->elts = elts;
+    }
+
+    tp = calloc(1, sizeof(ngx_thread_pool_t));
+    if (tp == NULL) {
+        LOG_ERROR("calloc() failed");
+        return NULL;
+    }
+
+    tp->name = strdup(name);
+    if (tp->name == NULL) {
+        free(tp);
+        LOG_ERROR("strdup() failed");
+        return NULL;
+    }
+
+    for (i = 0; i < NGX_THREAD_TASK_SLABS; i++) {
+        tp->slabs[i].size = (size_t) 64 << i;
+        tp->slabs[i].index = ngx_thread_task_slab_index++;
+    }
+
+    tp->max_queue = 65536;
+    tp->aging = 64;
+    tp->idle_timeout = 60000;
+    tp->grow_interval = 500;
+    tp->spin = 2048;
+    tp->fiber_stack = NGX_THREAD_FIBER_STACK;
+
+    /* the timer thread is started by the first delayed task */
+
+    if (ngx_thread_mutex_create(&tp->wheel.mtx) != NGX_OK
+        || ngx_thread_cond_create(&tp->wheel.cond) != NGX_OK)
+    {
+        free(tp->name);
+        free(tp);
+        return NULL;
+    }
+
+    tcf->elts[tcf->nelts++] = tp;
+
+    return tp;
+}
+
+
+ngx_thread_pool_t *
+ngx_thread_pool_get(const char *name)
+{
+    ngx_uint_t                i;
+    ngx_thread_pool_conf_t   *tcf;
+
+    tcf = &ngx_thread_pool_conf;
+
+    for (i = 0; i < tcf->nelts; i++) {
+        if (strcmp(tcf->elts[i]->name, name) == 0) {
+            return tcf->elts[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+const char *
+ngx_thread_pool_name(ngx_thread_pool_t *tp)
+{
+    return tp->name;
+}
+
+
+ngx_uint_t
+ngx_thread_pool_threads(ngx_thread_pool_t *tp)
+{
+    return tp->threads;
+}
+
+
+ngx_int_t
+ngx_thread_pool_conf_parse(const char *conf)
+{
+    char       *buf, *p, *line, *last;
+    ngx_int_t   rc;
+
+    buf = strdup(conf);
+    if (buf == NULL) {
+        LOG_ERROR("strdup() failed");
+        return NGX_ERROR;
+    }
+
+    /* strip comments */
+
+    for (p = buf; *p; p++) {
+        if (*p == '#') {
+            while (*p && *p != '\n') {
+                *p++ = ' ';
+            }
+
+            if (*p == '\0') {
+                break;
+            }
+        }
+    }
+
+    rc = NGX_OK;
+
+    for (line = strtok_r(buf, ";", &last);
+         line;
+         line = strtok_r(NULL, ";", &last))
+    {
+        rc = ngx_thread_pool_directive(line);
+        if (rc != NGX_OK) {
+            break;
+        }
+    }
+
+    free(buf);
+
+    return rc;
+}
+
+
+/* thread_pool name threads=number [max_queue=number] [parameter=value ...] */
+
+static ngx_int_t
+ngx_thread_pool_directive(char *line)
+{
+    char               *word, *last;
+    ngx_thread_pool_t  *tp;
+
+    word = strtok_r(line, " \t\r\n", &last);
+
+    if (word == NULL) {
+        return NGX_OK;
+    }
 
-    if (ngx_thread_mutex_create(&tp->mtx) != NGX_OK) {
+    if (strcmp(word, "thread_pool") != 0) {
+        LOG_ERROR("unknown directive \"%s\"", word);
         return NGX_ERROR;
     }
 
-    if (ngx_thread_cond_create(&tp->cond) != NGX_OK) {
-        (void) ngx_thread_mutex_destroy(&tp->mtx);
+    word = strtok_r(NULL, " \t\r\n", &last);
+
+    if (word == NULL) {
+        LOG_ERROR("invalid number of arguments in \"thread_pool\" directive");
         return NGX_ERROR;
     }
 
-    //tp->log = log;
-
-    err = pthread_attr_init(&attr);
-    if (err) {
-        //ngx_log_error(NGX_LOG_ALERT, log, err,
-        //              "pthread_attr_init() failed");
-        LOG_ERROR("pthread_attr_init() failed");
+    tp = ngx_thread_pool_add(word);
+    if (tp == NULL) {
         return NGX_ERROR;
     }
 
-#if 0
-    err = pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
-    if (err) {
-        //ngx_log_error(NGX_LOG_ALERT, log, err,
-        //              "pthread_attr_setstacksize() failed");
-        LOG_ERROR("pthread_attr_setstacksize() failed");
+    if (tp->threads) {
+        LOG_ERROR("duplicate thread pool \"%s\"", tp->name);
         return NGX_ERROR;
     }
-#endif
 
-    for (n = 0; n < tp->threads; n++) {
-        err = pthread_create(&tid, &attr, ngx_thread_pool_cycle, tp);
-        if (err) {
-            //ngx_log_error(NGX_LOG_ALERT, log, err,
-            //              "pthread_create() failed");
-            LOG_ERROR("pthread_create() failed");
+    while ((word = strtok_r(NULL, " \t\r\n", &last)) != NULL) {
+        if (ngx_thread_pool_set(tp, word) != NGX_OK) {
             return NGX_ERROR;
         }
     }
 
-    (void) pthread_attr_destroy(&attr);
+    if (tp->threads == 0) {
+        LOG_ERROR("\"%s\" must have \"threads\" parameter", tp->name);
+        return NGX_ERROR;
+    }
 
     return NGX_OK;
 }
 
 
-static void
-ngx_thread_pool_destroy(ngx_thread_pool_t *tp)
+ngx_int_t
+ngx_thread_pool_set(ngx_thread_pool_t *tp, const char *param)
 {
-    ngx_uint_t           n;
-    ngx_thread_task_t    task;
-    volatile ngx_uint_t  lock;
+    size_t                     len;
+    ngx_int_t                  n;
+    ngx_thread_pool_engine_t  *engine;
 
-    ngx_memzero(&task, sizeof(ngx_thread_task_t));
+    if (tp->started) {
+        LOG_ERROR("thread pool is already running, \"%s\" ignored", param);
+        return NGX_ERROR;
+    }
 
-    task.handler = ngx_thread_pool_exit_handler;
-    task.ctx = (void *) &lock;
+    len = strlen(param);
 
-    for (n = 0; n < tp->threads; n++) {
-        lock = 1;
+    if (strncmp(param, "threads=", 8) == 0) {
 
-        if (ngx_thread_task_post(tp, &task) != NGX_OK) {
-            return;
+        n = ngx_thread_pool_atoi(param + 8, len - 8);
+        if (n == NGX_ERROR || n == 0) {
+            goto invalid;
         }
 
-        while (lock) {
-            ngx_sched_yield();
+        tp->threads = n;
+
+        return NGX_OK;
+    }
+
+    if (strncmp(param, "max_queue=", 10) == 0) {
+
+        n = ngx_thread_pool_atoi(param + 10, len - 10);
+        if (n == NGX_ERROR) {
+            goto invalid;
         }
 
-        //task.event.active = 0;
+        tp->max_queue = n;
+
+        return NGX_OK;
     }
 
-    (void) ngx_thread_cond_destroy(&tp->cond);
+    if (strncmp(param, "min_threads=", 12) == 0) {
 
-    (void) ngx_thread_mutex_destroy(&tp->mtx);
-}
+        n = ngx_thread_pool_atoi(param + 12, len - 12);
+        if (n == NGX_ERROR || n == 0) {
+            goto invalid;
+        }
 
+        tp->min_threads = n;
 
-static void
-ngx_thread_pool_exit_handler(void *data)
-{
-    ngx_uint_t *lock = data;
+        return NGX_OK;
+    }
 
-    *lock = 0;
+    if (strncmp(param, "idle_timeout=", 13) == 0) {
 
-    pthread_exit(0);
-}
+        n = ngx_thread_pool_atoi(param + 13, len - 13);
+        if (n == NGX_ERROR || n == 0) {
+            goto invalid;
+        }
 
+        tp->idle_timeout = n;
 
-//ngx_thread_task_t *
-//ngx_thread_task_alloc(size_t size)
-//{
-//    ngx_thread_task_t  *task;
-//
-//    //task = ngx_pcalloc(pool, sizeof(ngx_thread_task_t) + size);
-//    task = malloc(sizeof(ngx_thread_task_t) + size);
-//    if (task == NULL) {
-//        return NULL;
-//    }
-//
-//    task->ctx = task + 1;
-//
-//    return task;
-//}
+        return NGX_OK;
+    }
 
+    if (strncmp(param, "grow_threshold=", 15) == 0) {
 
-ngx_int_t
-ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
-{
-    //if (task->event.active) {
-        //ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
-        //              "task #%ui already active", task->id);
-        //return NGX_ERROR;
-    //}
+        n = ngx_thread_pool_atoi(param + 15, len - 15);
+        if (n == NGX_ERROR) {
+            goto invalid;
+        }
 
-    if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
-        return NGX_ERROR;
+        tp->grow_threshold = n;
+
+        return NGX_OK;
     }
 
-    if (tp->waiting >= tp->max_queue) {
-        (void) ngx_thread_mutex_unlock(&tp->mtx);
+    if (strncmp(param, "grow_interval=", 14) == 0) {
 
-        //ngx_log_error(NGX_LOG_ERR, tp->log, 0,
-        //              "thread pool \"%V\" queue overflow: %i tasks waiting",
-        //              &tp->name, tp->waiting);
-        return NGX_ERROR;
+        n = ngx_thread_pool_atoi(param + 14, len - 14);
+        if (n == NGX_ERROR || n == 0) {
+            goto invalid;
+        }
+
+        tp->grow_interval = n;
+
+        return NGX_OK;
     }
 
-    //task->event.active = 1;
+    if (strncmp(param, "aging=", 6) == 0) {
 
-    task->id = ngx_thread_pool_task_id++;
-    task->next = NULL;
+        n = ngx_thread_pool_atoi(param + 6, len - 6);
+        if (n == NGX_ERROR) {
+            goto invalid;
+        }
 
-    if (ngx_thread_cond_signal(&tp->cond) != NGX_OK) {
-        (void) ngx_thread_mutex_unlock(&tp->mtx);
+        tp->aging = n;
+
+        return NGX_OK;
+    }
+
+    if (strcmp(param, "park=futex") == 0) {
+
+#if (NGX_HAVE_FUTEX)
+        tp->futex_park = 1;
+        return NGX_OK;
+#else
+        LOG_ERROR("\"%s\" is not supported on this platform", param);
         return NGX_ERROR;
+#endif
     }
 
-    *tp->queue.last = task;
-    tp->queue.last = &task->next;
+    if (strcmp(param, "park=cond") == 0) {
+        tp->futex_park = 0;
+        return NGX_OK;
+    }
 
-    tp->waiting++;
+    if (strcmp(param, "latency=on") == 0) {
+        tp->latency = 1;
+        return NGX_OK;
+    }
 
-    (void) ngx_thread_mutex_unlock(&tp->mtx);
+    if (strcmp(param, "latency=off") == 0) {
+        tp->latency = 0;
+        return NGX_OK;
+    }
 
-    //ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
-    //               "task #%ui added to thread pool \"%V\"",
-    //               task->id, &tp->name);
+    if (strcmp(param, "trace=off") == 0) {
+        tp->trace = 0;
+        return NGX_OK;
+    }
 
-    return NGX_OK;
-}
+    if (strncmp(param, "trace=", 6) == 0) {
 
+        n = ngx_thread_pool_atoi(param + 6, len - 6);
+        if (n == NGX_ERROR) {
+            goto invalid;
+        }
 
-static void *
-ngx_thread_pool_cycle(void *data)
-{
-    ngx_thread_pool_t *tp = data;
+        tp->trace = n;
 
-    int                 err;
-    sigset_t            set;
-    ngx_thread_task_t  *task;
+        return NGX_OK;
+    }
 
-#if 0
-    ngx_time_update();
-#endif
+    if (strcmp(param, "fibers=off") == 0) {
+        tp->fibers = 0;
+        return NGX_OK;
+    }
 
-    //ngx_log_debug1(NGX_LOG_DEBUG_CORE, tp->log, 0,
-    //               "thread in pool \"%V\" started", &tp->name);
+    if (strncmp(param, "fibers=", 7) == 0) {
 
-    sigfillset(&set);
+        n = ngx_thread_pool_atoi(param + 7, len - 7);
+        if (n == NGX_ERROR) {
+            goto invalid;
+        }
 
-    sigdelset(&set, SIGILL);
-    sigdelset(&set, SIGFPE);
-    sigdelset(&set, SIGSEGV);
-    sigdelset(&set, SIGBUS);
+        tp->fibers = n;
 
-    err = pthread_sigmask(SIG_BLOCK, &set, NULL);
-    if (err) {
-        //ngx_log_error(NGX_LOG_ALERT, tp->log, err, "pthread_sigmask() failed");
-        return NULL;
+        return NGX_OK;
     }
 
-    for ( ;; ) {
-        if (ngx_thread_mutex_lock(&tp->mtx) != NGX_OK) {
-            return NULL;
+    if (strncmp(param, "fiber_stack=", 12) == 0) {
+
+        n = ngx_thread_pool_size(param + 12, len - 12);
+        if (n == NGX_ERROR || n < 16 * 1024) {
+            goto invalid;
         }
 
-        /* the number may become negative */
-        tp->waiting--;
+        tp->fiber_stack = n;
 
-        while (tp->queue.first == NULL) {
-            if (ngx_thread_cond_wait(&tp->cond, &tp->mtx)
-                != NGX_OK)
-            {
-                (void) ngx_thread_mutex_unlock(&tp->mtx);
-                return NULL;
-            }
+        return NGX_OK;
+    }
+
+    if (strncmp(param, "spin=", 5) == 0) {
+
+        n = ngx_thread_pool_atoi(param + 5, len - 5);
+        if (n == NGX_ERROR) {
+            goto invalid;
         }
 
-        task = tp->queue.first;
-        tp->queue.first = task->next;
+        tp->spin = n;
+
+        return NGX_OK;
+    }
+
+    if (strncmp(param, "affinity=", 9) == 0) {
+
+#if (NGX_HAVE_CPU_AFFINITY)
 
-        if (tp->queue.first == NULL) {
-            tp->queue.last = &tp->queue.first;
+        if (strcmp(param + 9, "compact") == 0) {
+            tp->affinity = NGX_THREAD_POOL_AFFINITY_COMPACT;
+            return NGX_OK;
         }
 
-        if (ngx_thread_mutex_unlock(&tp->mtx) != NGX_OK) {
-            return NULL;
+        if (strcmp(param + 9, "scatter") == 0) {
+            tp->affinity = NGX_THREAD_POOL_AFFINITY_SCATTER;
+            return NGX_OK;
         }
 
-#if 0
-        ngx_time_update();
+        if (strcmp(param + 9, "numa") == 0) {
+            tp->affinity = NGX_THREAD_POOL_AFFINITY_NUMA;
+            return NGX_OK;
+        }
+
+        if (ngx_cpuset_parse(param + 9, &tp->cpus) == NGX_OK) {
+            tp->affinity = NGX_THREAD_POOL_AFFINITY_LIST;
+            return NGX_OK;
+        }
+
+        goto invalid;
+
+#else
+
+        LOG_ERROR("\"%s\" is not supported on this platform", param);
+        return NGX_ERROR;
+
 #endif
+    }
 
-        //ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
-        //               "run task #%ui in thread pool \"%V\"",
-        //               task->id, &tp->name);
+    if (strcmp(param, "route=node") == 0) {
+        tp->route = 1;
+        return NGX_OK;
+    }
 
-        task->handler(task->ctx);
+    if (strcmp(param, "route=any") == 0) {
+        tp->route = 0;
+        return NGX_OK;
+    }
 
-        //ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
-        //               "complete task #%ui in thread pool \"%V\"",
-        //               task->id, &tp->name);
+    if (strncmp(param, "queue=", 6) == 0) {
 
-        task->next = NULL;
-        
-        //ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
-        //
-        //*ngx_thread_pool_done.last = task;
-        //ngx_thread_pool_done.last = &task->next;
-        //
-        //ngx_memory_barrier();
-        //
-        //ngx_unlock(&ngx_thread_pool_done_lock);
+        for (engine = ngx_thread_pool_engines; engine->name; engine++) {
+            if (strcmp(param + 6, engine->name) == 0) {
+                tp->engine = engine;
+                return NGX_OK;
+            }
+        }
 
-        //this is nginx call(notify) event after the task is done
-        //(void) ngx_notify(ngx_thread_pool_handler);
+        goto invalid;
     }
+
+invalid:
+
+    LOG_ERROR("invalid thread pool parameter \"%s\"", param);
+
+    return NGX_ERROR;
 }
 
 
-//static void
-//ngx_thread_pool_handler()
-//{
-//    ngx_event_t        *event;
-//    ngx_thread_task_t  *task;
-//
-//    //ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
-//
-//    ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
-//
-//    task = ngx_thread_pool_done.first;
-//    ngx_thread_pool_done.first = NULL;
-//    ngx_thread_pool_done.last = &ngx_thread_pool_done.first;
-//
-//    ngx_memory_barrier();
-//
-//    ngx_unlock(&ngx_thread_pool_done_lock);
-//
-//    while (task) {
-//        //ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
-//        //               "run completion handler for task #%ui", task->id);
-//
-//        event = &task->event;
-//        task = task->next;
-//
-//        event->complete = 1;
-//        event->active = 0;
-//
-//        event->handler(event);
-//    }
-//}
-//
+static ngx_int_t
+ngx_thread_pool_atoi(const char *line, size_t n)
+{
+    ngx_int_t  value, cutoff, cutlim;
 
-//config me
-ngx_thread_pool_t* 
-ngx_thread_pool_config(ngx_uint_t threads)
+    if (n == 0) {
+        return NGX_ERROR;
+    }
+
+    cutoff = NGX_MAX_INT_T_VALUE / 10;
+    cutlim = NGX_MAX_INT_T_VALUE % 10;
+
+    for (value = 0; n--; line++) {
+        if (*line < '0' || *line > '9') {
+            return NGX_ERROR;
+        }
+
+        if (value >= cutoff && (value > cutoff || *line - '0' > cutlim)) {
+            return NGX_ERROR;
+        }
+
+        value = value * 10 + (*line - '0');
+    }
+
+    return value;
+}
+
+
+/* a size in bytes, or with a "k" or "m" suffix */
+
+static ngx_int_t
+ngx_thread_pool_size(const char *line, size_t n)
 {
-    ngx_int_t max_queue = 65536;
-    if (threads < 1) {
-        threads = 1;
+    ngx_int_t  scale, value;
+
+    if (n == 0) {
+        return NGX_ERROR;
     }
-    
-    ngx_thread_pool_t* tp = &g_tp;
-    
-    if (tp->threads) {
-        return tp;
+
+    switch (line[n - 1]) {
+
+    case 'K':
+    case 'k':
+        scale = 1024;
+        n--;
+        break;
+
+    case 'M':
+    case 'm':
+        scale = 1024 * 1024;
+        n--;
+        break;
+
+    default:
+        scale = 1;
     }
-    
-    tp->threads = threads;
-    tp->max_queue = max_queue;
-    
-    return tp;
+
+    value = ngx_thread_pool_atoi(line, n);
+    if (value == NGX_ERROR || value > NGX_MAX_INT_T_VALUE / scale) {
+        return NGX_ERROR;
+    }
+
+    return value * scale;
 }
 
+
 ngx_int_t
 ngx_thread_pool_init_worker(ngx_thread_pool_t* tp)
 {
-    //ngx_uint_t                i;
-    //ngx_thread_pool_t       **tpp;
-    //ngx_thread_pool_conf_t   *tcf;
-
-    //if (ngx_process != NGX_PROCESS_WORKER
-    //    && ngx_process != NGX_PROCESS_SINGLE)
-    //{
-    //    return NGX_OK;
-    //}
+    ngx_uint_t                i;
+    ngx_thread_pool_conf_t   *tcf;
 
-    //tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
-    //                                              ngx_thread_pool_module);
-    //
-    //if (tcf == NULL) {
-    //    return NGX_OK;
-    //}
-    //
-    //ngx_thread_pool_queue_init(&ngx_thread_pool_done);
-    //
-    //tpp = tcf->pools.elts;
-    //
-    //for (i = 0; i < tcf->pools.nelts; i++) {
-    //    if (ngx_thread_pool_init(tpp[i], cycle->log, cycle->pool) != NGX_OK) {
-    //        return NGX_ERROR;
-    //    }
-    //}
-    
     ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
     LOG_INFO("ncpu %d",ngx_ncpu);
-    
-    if (ngx_thread_pool_init(tp) != NGX_OK) {
-        return NGX_ERROR;
+
+    if (tp) {
+        return ngx_thread_pool_init_pool(tp);
+    }
+
+    tcf = &ngx_thread_pool_conf;
+
+    for (i = 0; i < tcf->nelts; i++) {
+        if (ngx_thread_pool_init_pool(tcf->elts[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
     }
 
     return NGX_OK;
 }
 
 
+static ngx_int_t
+ngx_thread_pool_init_pool(ngx_thread_pool_t *tp)
+{
+    if (tp->started) {
+        return NGX_OK;
+    }
+
+    if (tp->threads == 0) {
+
+        if (strcmp(tp->name, "default") != 0) {
+            LOG_ERROR("unknown thread pool \"%s\"", tp->name);
+            return NGX_ERROR;
+        }
+
+        tp->threads = 32;
+    }
+
+    return ngx_thread_pool_init(tp);
+}
+
+
 void
 ngx_thread_pool_exit_worker(ngx_thread_pool_t* tp)
 {
-    //ngx_uint_t                i;
-    //ngx_thread_pool_t       **tpp;
-    //ngx_thread_pool_conf_t   *tcf;
+    ngx_uint_t                i;
+    ngx_thread_pool_conf_t   *tcf;
 
-    //if (ngx_process != NGX_PROCESS_WORKER
-    //    && ngx_process != NGX_PROCESS_SINGLE)
-    //{
-    //    return;
-    //}
-    //
-    //tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
-    //                                              ngx_thread_pool_module);
-    //
-    //if (tcf == NULL) {
-    //    return;
-    //}
-    //
-    //tpp = tcf->pools.elts;
-    //
-    //for (i = 0; i < tcf->pools.nelts; i++) {
-    //    ngx_thread_pool_destroy(tpp[i]);
-    //}
-    
-    ngx_thread_pool_destroy(tp);
+    if (tp) {
+        (void) ngx_thread_pool_shutdown(tp, NGX_THREAD_POOL_DRAIN, 0, NULL);
+
+        return;
+    }
+
+    tcf = &ngx_thread_pool_conf;
+
+    for (i = 0; i < tcf->nelts; i++) {
+        (void) ngx_thread_pool_shutdown(tcf->elts[i], NGX_THREAD_POOL_DRAIN,
+                                        0, NULL);
+    }
 }
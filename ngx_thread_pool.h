@@ -3,27 +3,388 @@
 #define _NGX_THREAD_POOL_H_INCLUDED_
 
 #include "ngx_common.h"
+#include "ngx_thread.h"
 
-typedef struct ngx_thread_task_s  ngx_thread_task_t;
+#define NGX_THREAD_TASK_PRIORITIES  4
+
+#define NGX_THREAD_TASK_DONE        0
+#define NGX_THREAD_TASK_CANCELLED   1
+#define NGX_THREAD_TASK_EXPIRED     2
+
+typedef struct ngx_thread_task_s    ngx_thread_task_t;
+typedef struct ngx_thread_pool_s    ngx_thread_pool_t;
+typedef struct ngx_thread_future_s  ngx_thread_future_t;
 
 struct ngx_thread_task_s {
-    ngx_thread_task_t   *next; //no need set
+    ngx_thread_task_t   *next; //no need set, links a chain for post_chain
     ngx_uint_t           id; //task id, no need set
     void                *ctx; //save ctx for handler, user set
     void               (*handler)(void *data); //user set
+    void               (*complete)(ngx_thread_task_t *task); //user set, optional, see ngx_thread_pool_process_completions()
+    ngx_uint_t           priority; //user set, optional, 0 (default) .. NGX_THREAD_TASK_PRIORITIES - 1 (most urgent)
+    void                *slab; //no need set, see ngx_thread_task_alloc()
+    ngx_msec_t           deadline; //user set, optional, ngx_monotonic_msec() time after which the task is skipped, 0 (default) never
+    volatile ngx_uint_t  state; //no need set
+    ngx_uint_t           status; //no need set, NGX_THREAD_TASK_DONE, _CANCELLED or _EXPIRED for the complete handler
+    ngx_thread_future_t *future; //no need set, see ngx_thread_task_post_future()
+    ngx_thread_pool_t   *pool; //no need set, the pool the task is posted to
+    ngx_thread_task_t   *successor; //no need set, see ngx_thread_task_depend()
+    volatile ngx_uint_t  deps; //no need set
+    uint64_t             queued; //no need set, ngx_monotonic_usec() time of posting with "latency=on" or "trace=N"
+    ngx_msec_t           timer; //no need set, ngx_monotonic_msec() time a delayed task is due
+    ngx_msec_t           period; //no need set, see ngx_thread_task_post_periodic()
 };
 
 
-typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
+ngx_thread_pool_t* ngx_thread_pool_config(ngx_uint_t threads); //the "default" pool
+
+/*
+ * named pools: ngx_thread_pool_add() finds or creates a pool, and
+ * ngx_thread_pool_conf_parse() configures pools from nginx style directives:
+ *
+ *   thread_pool disk threads=16 max_queue=1024;
+ *   thread_pool gzip threads=4 queue=ring;
+ *
+ * ngx_thread_pool_init_worker(NULL) and ngx_thread_pool_exit_worker(NULL)
+ * start and stop all configured pools
+ */
+ngx_thread_pool_t *ngx_thread_pool_add(const char *name);
+ngx_thread_pool_t *ngx_thread_pool_get(const char *name);
+const char *ngx_thread_pool_name(ngx_thread_pool_t *tp);
+ngx_uint_t ngx_thread_pool_threads(ngx_thread_pool_t *tp); //the maximum number
+ngx_int_t ngx_thread_pool_conf_parse(const char *conf);
 
+/*
+ * set a pool parameter before ngx_thread_pool_init_worker():
+ *   "threads=N", "max_queue=N" (the "list" queue holds exactly N tasks;
+ *              the "ring" queue holds N rounded up to a power of two;
+ *              the "steal" queue limits single posts to N / threads per
+ *              worker inbox, but a worker moves its inbox into its deque
+ *              once the deque runs empty, so up to about 2 * N tasks may
+ *              wait, and batches may fill every inbox and deque up to
+ *              N rounded up to a power of two),
+ *   "min_threads=N" (start N workers and grow up to "threads" under load),
+ *   "idle_timeout=MS" (workers above min_threads exit when idle that long,
+ *                      default 60000),
+ *   "grow_threshold=N", "grow_interval=MS" (add a worker when more than N
+ *                      tasks wait for an interval, defaults 0 and 500),
+ *   "aging=N" (a lower priority class is served after being passed over
+ *              N times, 0 disables aging, default 64),
+ *   "queue=list" (mutex guarded list, default) or
+ *   "queue=ring" (lock-free bounded ring of max_queue tasks) or
+ *   "queue=steal" (per worker deques with work stealing),
+ *   "park=futex", "spin=N" (idle workers poll the queue N times, default
+ *              2048, then sleep on a futex, and posts only make a wake
+ *              syscall if a worker sleeps; "park=cond" is the default),
+ *   "affinity=compact|scatter|numa" or "affinity=0,2,4-7" (pin workers
+ *              to hyperthreads of a core first, to separate cores first,
+ *              to all cpus of a NUMA node, or to the listed cpus),
+ *   "route=node" (the "steal" queue posts to and steals from workers on
+ *              the caller's NUMA node first, implies "affinity=numa"
+ *              unless set),
+ *   "latency=on" (workers time the queue wait and the run of each task
+ *              for ngx_thread_pool_stats(), "latency=off" is the default),
+ *   "trace=N" (every worker keeps a record of the last N tasks it has
+ *              taken for ngx_thread_pool_trace_dump(), "trace=off" is
+ *              the default),
+ *   "fibers=N", "fiber_stack=size" (workers run tasks on up to N fibers
+ *              with stacks of size bytes, default 128k, so handlers may
+ *              wait without blocking them, see ngx_thread_task_yield();
+ *              "fibers=off" is the default)
+ *
+ * task priorities are honoured by the "list" queue only, the lock-free
+ * queues run tasks of all classes in one queue
+ */
+ngx_int_t ngx_thread_pool_set(ngx_thread_pool_t *tp, const char *param);
 
-ngx_thread_pool_t* ngx_thread_pool_config(ngx_uint_t threads);
+/*
+ * a task with size bytes of zeroed ctx right after it, taken from the
+ * pool's slabs through a per thread cache; contexts over 1024 bytes come
+ * from the heap.  A posted task returns to its slab by itself once its
+ * handler, or its complete handler if set, has run, so it must not be
+ * touched or posted again after that; ngx_thread_task_free() is only
+ * for tasks that were never posted or never run.
+ */
+ngx_thread_task_t *ngx_thread_task_alloc(ngx_thread_pool_t *tp, size_t size);
+void ngx_thread_task_free(ngx_thread_task_t *task);
 
-//ngx_thread_task_t *ngx_thread_task_alloc(size_t size);
+/*
+ * a task posted by a handler to its own pool runs next on the same worker,
+ * while its data is still in cache: it waits in the worker's slot, and a
+ * task already there moves to the queue, where other workers take it.
+ * Every 16 tasks in a row from the slot go through the queue instead, so
+ * a chain of handlers posting each other does not starve the queue.
+ * Tasks in the slot are not ordered by priority.  The slot counts against
+ * max_queue, and a worker moves its task to the queue before it sleeps in
+ * ngx_thread_latch_wait(), ngx_thread_future_wait() or
+ * ngx_thread_task_post_wait(), so a handler may wait for a task it posted.
+ */
 ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
 
+/*
+ * ngx_thread_task_post_delayed() queues the task after delay ms, and
+ * ngx_thread_task_post_periodic() after delay ms and then every period ms
+ * after each run, until it is cancelled or its handler sets task->period
+ * to 0; cancelling it while it runs lets that run finish.  The tasks wait
+ * in a timer wheel of the pool, which one timer thread moves due tasks
+ * from to the queue with a resolution of 1 ms.  The complete handler and
+ * future of a periodic task are called once it stops.  A cancelled task
+ * is reported when it is due.  Delayed tasks may not have predecessors,
+ * and those not due yet when the pool shuts down are returned as left.
+ */
+ngx_int_t ngx_thread_task_post_delayed(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_msec_t delay);
+ngx_int_t ngx_thread_task_post_periodic(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_msec_t delay, ngx_msec_t period);
+
+/*
+ * ngx_thread_task_try_post() returns NGX_BUSY instead of NGX_ERROR if the
+ * queue is full, and sets *depth to the number of queued tasks either way.
+ * ngx_thread_task_post_wait() sleeps on a full queue until a worker takes
+ * a task off it, for up to timeout ms (NGX_TIMER_INFINITE waits forever),
+ * and returns NGX_AGAIN if the queue is still full then, or NGX_ERROR if
+ * the pool shuts down.
+ */
+ngx_int_t ngx_thread_task_try_post(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_uint_t *depth);
+#if (NGX_HAVE_FUTEX)
+ngx_int_t ngx_thread_task_post_wait(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_msec_t timeout);
+#endif
+
+/*
+ * queue n tasks, or a chain of tasks linked with task->next, at once:
+ * the queue is locked and checked against max_queue once, and at most
+ * min(n, idle workers) threads are woken up.  On NGX_ERROR no task
+ * of the batch is queued.
+ */
+ngx_int_t ngx_thread_task_post_batch(ngx_thread_pool_t *tp,
+    ngx_thread_task_t **tasks, ngx_uint_t n);
+ngx_int_t ngx_thread_task_post_chain(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task);
+
+#if (NGX_HAVE_FUTEX)
+
+/*
+ * ngx_thread_task_post_future() posts a task that completes the caller's
+ * future once a worker has run or skipped it, before its complete handler
+ * is called.  A future can be polled with ngx_thread_future_done(), waited
+ * for with a timeout (NGX_AGAIN if it has passed), and chained with
+ * ngx_thread_future_then(), which posts a task to a pool when the future
+ * completes, or right away if it already has.  Several tasks may be posted
+ * with one future, which then completes when all of them have: such a
+ * future is a task group, all tasks should be posted before it is waited
+ * for or chained.  future->status is NGX_THREAD_TASK_DONE, or the status of
+ * a task that did not run.  A task that fails to post completes the future
+ * as cancelled.
+ */
+
+struct ngx_thread_future_s {
+    ngx_thread_latch_t          latch;
+    ngx_atomic_t                pending;
+    ngx_uint_t                  status;
+    ngx_thread_task_t          *then;
+    ngx_atomic_t                lock;
+};
+
+typedef ngx_thread_future_t  ngx_thread_group_t;
+
+void ngx_thread_future_init(ngx_thread_future_t *future);
+ngx_int_t ngx_thread_task_post_future(ngx_thread_pool_t *tp,
+    ngx_thread_task_t *task, ngx_thread_future_t *future);
+ngx_int_t ngx_thread_future_wait(ngx_thread_future_t *future,
+    ngx_msec_t timeout);
+ngx_int_t ngx_thread_future_then(ngx_thread_future_t *future,
+    ngx_thread_pool_t *tp, ngx_thread_task_t *task);
+
+#define ngx_thread_future_done(future)  ngx_thread_latch_done(&(future)->latch)
+
+#define ngx_thread_group_init(group)  ngx_thread_future_init(group)
+#define ngx_thread_group_post(group, tp, task)                                \
+    ngx_thread_task_post_future(tp, task, group)
+#define ngx_thread_group_wait(group, timeout)                                 \
+    ngx_thread_future_wait(group, timeout)
+
+#endif
+
+/*
+ * makes task wait for pred: posting the task only records its pool, and
+ * the worker that finishes the last of its predecessors runs it next, so
+ * their data is still in cache, or queues it if it was posted to another
+ * pool.  A task may have many predecessors but only one successor, and a
+ * dependency must be declared before either task is posted.  If a
+ * predecessor is cancelled or expires, the successor is cancelled too.
+ * Tasks with predecessors must be posted with ngx_thread_task_post().
+ */
+ngx_int_t ngx_thread_task_depend(ngx_thread_task_t *task,
+    ngx_thread_task_t *pred);
+
+/*
+ * tasks posted to a strand run one at a time in posting order, with no
+ * lock held by a worker while it waits: the strand is queued to its pool
+ * as one unit, and the worker that takes it runs up to 32 of its tasks,
+ * then queues it again behind other work if it has more.  A table of
+ * strands serializes the tasks posted with the same key, e.g. per
+ * connection or per file, keys that share a strand are serialized too.
+ * Strand tasks may be cancelled and have deadlines, but may not have
+ * predecessors; a strand must not be freed while it has tasks.
+ */
+
+typedef struct ngx_thread_strand_s  ngx_thread_strand_t;
+
+struct ngx_thread_strand_s {
+    ngx_thread_pool_t          *pool;
+    ngx_atomic_t                lock;
+    ngx_uint_t                  busy;
+    ngx_thread_task_t          *first;
+    ngx_thread_task_t         **last;
+    ngx_thread_task_t           task;
+};
+
+typedef struct {
+    ngx_thread_strand_t        *strand;
+    ngx_uint_t                  mask;
+} ngx_thread_strands_t;
+
+void ngx_thread_strand_init(ngx_thread_strand_t *strand, ngx_thread_pool_t *tp);
+ngx_int_t ngx_thread_strand_post(ngx_thread_strand_t *strand,
+    ngx_thread_task_t *task);
+
+/*
+ * code that runs a strand's tasks by other means for a while keeps the
+ * strand busy meanwhile, tasks posted then queue up behind; resuming it
+ * puts task, unless NULL, in front of them and queues the strand to its
+ * pool, so workers run them in order, see ngx_thread_file_uring().  It does
+ * not block: if the queue is full, the strand waits for room aside.
+ */
+void ngx_thread_strand_resume(ngx_thread_strand_t *strand,
+    ngx_thread_task_t *task);
+
+/* n is rounded up to a power of two */
+ngx_int_t ngx_thread_strands_init(ngx_thread_strands_t *strands,
+    ngx_thread_pool_t *tp, ngx_uint_t n);
+ngx_int_t ngx_thread_strands_post(ngx_thread_strands_t *strands,
+    ngx_uint_t key, ngx_thread_task_t *task);
+
+/*
+ * withdraws a posted task that has not started: it stays in the queue
+ * until a worker takes it, which then skips it, the same way as a task
+ * past its deadline, and reports it to the complete handler with
+ * NGX_THREAD_TASK_CANCELLED.  Returns NGX_DECLINED if the task has
+ * already started.  An ngx_thread_task_alloc() task needs a complete
+ * handler to be cancelled safely, otherwise it may be freed already.
+ */
+ngx_int_t ngx_thread_task_cancel(ngx_thread_task_t *task);
+
+/*
+ * lets a handler do the work of a queued task along with its own, e.g.
+ * to batch it: a claimed task is no longer run, and the worker that takes
+ * it reports it as done.  Returns NGX_DECLINED if the task has already
+ * started or has been cancelled.
+ */
+ngx_int_t ngx_thread_task_claim(ngx_thread_task_t *task);
+
+/*
+ * in a pool with "fibers=N" a handler runs on a fiber, and
+ * ngx_thread_future_wait() with no timeout suspends the fiber instead of
+ * blocking the worker, which runs other tasks until the future completes;
+ * the handler then goes on, possibly on another worker.
+ * ngx_thread_task_yield() suspends it behind the queued tasks, e.g. to
+ * poll for a lock.  Handlers of strands, and handlers started when all N
+ * fibers are suspended, run on the worker's stack and block as usual.  A
+ * handler must not keep thread local data, errno included, across a wait,
+ * and must fit in the fiber's stack.  A pool does not shut down while a
+ * fiber waits.
+ */
+void ngx_thread_task_yield(void);
+
+/*
+ * tasks with a complete handler are queued to the pool's done queue after
+ * their handler has run, and the notify eventfd becomes readable; the event
+ * loop adds the fd to epoll and calls ngx_thread_pool_process_completions(),
+ * which runs the complete handlers of all finished tasks in the calling
+ * thread and returns their number
+ */
+int ngx_thread_pool_notify_fd(ngx_thread_pool_t *tp);
+ngx_int_t ngx_thread_pool_process_completions(ngx_thread_pool_t *tp);
+
+/*
+ * sets a completion source that makes the notify eventfd readable itself,
+ * e.g. an io_uring with the eventfd registered: after the complete
+ * handlers ngx_thread_pool_process_completions() calls handler, which runs
+ * the completions of the source and returns their number
+ */
+typedef ngx_int_t (*ngx_thread_pool_poll_pt)(void *data);
+
+void ngx_thread_pool_set_poll(ngx_thread_pool_t *tp,
+    ngx_thread_pool_poll_pt handler, void *data);
+
+/*
+ * counters of a pool since it was started, kept per worker and in per
+ * producer shards and summed up without locking, so a snapshot taken
+ * under load is consistent only approximately.  With "latency=on" wait[i]
+ * and run[i] count tasks that waited in the queue, or ran, for 2^(i-1) to
+ * 2^i - 1 microseconds, wait[0] and run[0] less than one, and the last
+ * bucket everything longer.
+ */
+
+#define NGX_THREAD_POOL_BUCKETS  32
+
+typedef struct {
+    ngx_uint_t           completed; //handlers run
+    ngx_uint_t           skipped; //cancelled or expired tasks
+    uint64_t             busy; //microseconds spent in handlers
+    ngx_uint_t           wait[NGX_THREAD_POOL_BUCKETS];
+    ngx_uint_t           run[NGX_THREAD_POOL_BUCKETS];
+} ngx_thread_worker_stats_t;
+
+typedef struct {
+    ngx_uint_t           posted;
+    ngx_uint_t           rejected; //posts failed on a full queue or abort
+    ngx_uint_t           depth; //tasks queued now
+    ngx_uint_t           threads; //workers running now
+    ngx_uint_t           idle; //workers waiting for tasks now
+    ngx_thread_worker_stats_t  total; //sum over all workers
+} ngx_thread_pool_stats_t;
+
+/*
+ * fills stats, and workers with up to n per worker entries, indexed as
+ * the workers of the pool, and returns the number of entries filled;
+ * must not be called concurrently with ngx_thread_pool_shutdown()
+ */
+ngx_uint_t ngx_thread_pool_stats(ngx_thread_pool_t *tp,
+    ngx_thread_pool_stats_t *stats, ngx_thread_worker_stats_t *workers,
+    ngx_uint_t n);
+
+/*
+ * writes the task records of a pool with "trace=N", or of all pools if
+ * tp is NULL, to path in the Chrome trace event format for Perfetto or
+ * chrome://tracing: every task run or skipped is a slice on its worker's
+ * thread track, and its time in the queue, from posting till a worker
+ * took it, an async slice on the pool's "queue" track.  May be called
+ * while the pool runs, and after it has been shut down.
+ */
+ngx_int_t ngx_thread_pool_trace_dump(ngx_thread_pool_t *tp, const char *path);
+
 ngx_int_t ngx_thread_pool_init_worker(ngx_thread_pool_t* tp);
-void ngx_thread_pool_exit_worker(ngx_thread_pool_t* tp);
+void ngx_thread_pool_exit_worker(ngx_thread_pool_t* tp); //drains and joins
+
+#define NGX_THREAD_POOL_DRAIN  1
+#define NGX_THREAD_POOL_ABORT  2
+
+/*
+ * stops the pool and joins its threads: NGX_THREAD_POOL_DRAIN runs all
+ * queued tasks first, NGX_THREAD_POOL_ABORT lets running handlers finish
+ * but runs no more tasks.  A drain that has not finished in timeout ms
+ * (0 waits forever) turns into an abort.  Tasks taken off the queue unrun
+ * are returned in *left as a chain linked with task->next, and the
+ * function returns NGX_ABORT; tasks of ngx_thread_task_alloc() among them
+ * must be freed with ngx_thread_task_free().  Complete handlers of tasks
+ * that have run are still called by ngx_thread_pool_process_completions().
+ * The pool may be started again with ngx_thread_pool_init_worker().
+ */
+ngx_int_t ngx_thread_pool_shutdown(ngx_thread_pool_t *tp, ngx_uint_t mode,
+    ngx_msec_t timeout, ngx_thread_task_t **left);
 
 
 #endif /* _NGX_THREAD_POOL_H_INCLUDED_ */